@@ -1,6 +1,18 @@
+#ifndef STEPPER_H__
+#define STEPPER_H__
+
 #include <stdint.h>
 #include <stdbool.h>
 
+// build-time configuration, optional: put a `stepper_config.h` in your include path to select
+// the mcu, enable DEBUG, or declare fixed instances (see `stepper_fixed.h`), instead of editing
+// this file. every macro below can also be passed as a compiler flag, e.g. `-D MCU_ESP32C3`.
+#if defined(__has_include)
+#if __has_include("stepper_config.h")
+#include "stepper_config.h"
+#endif
+#endif
+
 // #define DEBUG
 
 /************************************** mcu marco ****************************************/
@@ -10,10 +22,35 @@
 // #define MCU_ESP32S2
 // #define MCU_ESP32S3
 // #define MCU_NRF52832
-#define MCU_NRF52833
+// #define MCU_NRF52833
 // #define MCU_NRF52840
 // #define MCU_NRF5340
 
+// detected from the framework when not selected explicitly, fallback to the soft (host) backend.
+#if !defined(MCU_ESP32C2) & !defined(MCU_ESP32C3) & !defined(MCU_ESP32S2) & !defined(MCU_ESP32S3) & \
+    !defined(MCU_NRF52832) & !defined(MCU_NRF52833) & !defined(MCU_NRF52840) & !defined(MCU_NRF5340)
+#if defined(ESP_PLATFORM)
+#include "sdkconfig.h"
+#endif
+#if   defined(CONFIG_IDF_TARGET_ESP32C2)
+#define MCU_ESP32C2
+#elif defined(CONFIG_IDF_TARGET_ESP32C3)
+#define MCU_ESP32C3
+#elif defined(CONFIG_IDF_TARGET_ESP32S2)
+#define MCU_ESP32S2
+#elif defined(CONFIG_IDF_TARGET_ESP32S3)
+#define MCU_ESP32S3
+#elif defined(CONFIG_SOC_NRF52832) | defined(CONFIG_SOC_NRF52832_QFAA) | defined(CONFIG_SOC_NRF52832_QFAB) | defined(CONFIG_SOC_NRF52832_CIAA)
+#define MCU_NRF52832
+#elif defined(CONFIG_SOC_NRF52833) | defined(CONFIG_SOC_NRF52833_QIAA)
+#define MCU_NRF52833
+#elif defined(CONFIG_SOC_NRF52840) | defined(CONFIG_SOC_NRF52840_QIAA)
+#define MCU_NRF52840
+#elif defined(CONFIG_SOC_NRF5340_CPUAPP) | defined(CONFIG_SOC_NRF5340_CPUAPP_QKAA)
+#define MCU_NRF5340
+#endif
+#endif
+
 #if defined(MCU_ESP32C2) | defined(MCU_ESP32C3)
 #define MCU_ESP32Cx
 #endif
@@ -34,6 +71,10 @@
 #define MCU_NORDIC_RF
 #endif
 
+#if !defined(MCU_ESP32) & !defined(MCU_NORDIC_RF) & !defined(MCU_STM32) & !defined(MCU_STM8)
+#define MCU_SOFT
+#endif
+
 
 /************************************ stepper header **************************************/
 
@@ -56,6 +97,26 @@ typedef struct {
 */
 #define STEPPER_INSTANCE(idx_) { .instance_id = idx_, }
 
+typedef enum {
+  STEPPER_EVENT_STALL = 0,    // following error exceeded `stall_steps`, motor was stopped.
+  STEPPER_EVENT_CORRECTION,   // following error exceeded `correction_steps`, step rate is being trimmed.
+  STEPPER_EVENT_RECOVERED,    // following error is back within `correction_steps`, trim removed.
+} stepper_event_t;
+
+/**
+ * @brief closed-loop event callback, called from the esp_timer task (ESP32) / system workqueue (nRF52), keep it short.
+ *
+ * @param following_error commanded position minus encoder position, in steps.
+*/
+typedef void (*stepper_event_handler_t)(stepper_t const * stepper, stepper_event_t event, int32_t following_error);
+
+typedef enum {
+  STEPPER_SHAPER_NONE = 0,
+  STEPPER_SHAPER_ZV,          // 2 impulses, shortest delay (1/2 damped period), least robust.
+  STEPPER_SHAPER_ZVD,         // 3 impulses, 1 damped period of delay.
+  STEPPER_SHAPER_EI,          // 3 impulses, 1 damped period of delay, tolerates 5% residual vibration.
+} stepper_shaper_type_t;
+
 typedef struct {
 #if defined(MCU_NORDIC_RF)
   int32_t  pin_dirs[4];
@@ -65,11 +126,37 @@ typedef struct {
   int32_t  pin_pulse;
 #endif
   uint32_t subdivision;   // 细分，电机一圈的步数，一般步进电机为 200 步，也就是一步 1.8˚
-  uint32_t pulse_us;      // 每个脉冲最短有效时长，默认 5us
+  uint32_t pulse_us;      // 每个脉冲最短有效时长，默认 5us；双边沿模式下为每个电平的最短时长
+  bool     dual_edge;     // 双边沿步进：STEP 每步翻转一次（50% 占空比），同样的外设可达两倍步频，需驱动器支持
   float    rpm;           // 每分钟转速
   bool     direction;     // 转向
+  // closed-loop feedback, optional:
+  int32_t  pin_enc_a;     // 编码器 A 相，-1 表示开环运行；需要硬件计数器（ESP32 PCNT / nRF52 QDEC），ESP32-C3 等无 PCNT 的芯片上初始化返回 INVALID_PARAMETERS
+  int32_t  pin_enc_b;     // 编码器 B 相
+  uint32_t encoder_cpr;   // 编码器每圈计数（四倍频后），0 表示开环运行
+  uint32_t correction_steps;  // 跟随误差超过该步数时修正转速，0 表示不修正
+  uint32_t stall_steps;       // 跟随误差超过该步数时判定为堵转并停机，0 表示不检测
+  stepper_event_handler_t event_handler;
+  // input shaping, optional:
+  stepper_shaper_type_t shaper;   // 整形器类型，默认不整形
+  float    shaper_freq_hz;        // 机械共振频率
+  float    shaper_damping;        // 阻尼比，0 ~ 1，一般 0.05 ~ 0.1
+  // low-power idle, optional:
+  int32_t  pin_enable;            // 驱动器使能引脚，-1 表示不控制
+  bool     enable_active_high;    // 使能电平，默认低电平使能（TMC / A4988 等）
+  uint32_t idle_hold_ms;          // 停止后保持力矩的时长，超时后释放外设时钟并断开驱动器，0 表示不进入低功耗；双边沿模式下需要 pin_enable；最大 STEPPER_IDLE_HOLD_MS_MAX
 } stepper_config_t;
 
+#define STEPPER_IDLE_HOLD_MS_MAX  (UINT32_MAX / 1000)  // ~71 minutes, kept in microseconds.
+
+typedef struct {
+  uint64_t idle_us;               // 累计低功耗时长，包括当前这一次
+  uint32_t wake_count;
+  uint32_t wake_latency_us;       // 最近一次唤醒，从调用到步进输出恢复的时长
+  uint32_t wake_latency_max_us;
+  bool     idle;
+} stepper_idle_stats_t;
+
 #if defined(MCU_NORDIC_RF)
 #define STEPPER_CONFIG(pin_dir_, pin_pulse_) {       \
   .pin_dirs     = { pin_dir_, pin_dir_, pin_dir_, pin_dir_ },          \
@@ -78,6 +165,10 @@ typedef struct {
   .subdivision  = 3200,                              \
   .rpm          = 10,                                \
   .direction    = 0,                                 \
+  .pin_enc_a    = -1,                                \
+  .pin_enc_b    = -1,                                \
+  .encoder_cpr  = 0,                                 \
+  .pin_enable   = -1,                                \
 }
 #else
 #define STEPPER_CONFIG(pin_dir_, pin_pulse_) {       \
@@ -87,6 +178,10 @@ typedef struct {
   .subdivision  = 3200,                              \
   .rpm          = 10,                                \
   .direction    = 0,                                 \
+  .pin_enc_a    = -1,                                \
+  .pin_enc_b    = -1,                                \
+  .encoder_cpr  = 0,                                 \
+  .pin_enable   = -1,                                \
 }
 #endif
 
@@ -98,7 +193,9 @@ typedef struct {
  * 
  * @return `stepper_err_t`
  *    - SUCCESS             initialize successfully.
- *    - INVALID_PARAMETERS  make sure your instance id is valid, and GPIO pin is avaliable.
+ *    - INVALID_PARAMETERS  make sure your instance id is valid, GPIO pin is avaliable, and shaper parameters are valid.
+ *                          `config.idle_hold_ms` with `config.dual_edge` needs `config.pin_enable`, and is at
+ *                          most `STEPPER_IDLE_HOLD_MS_MAX`.
  *    - INVALID_STATE       this instance was already initialized, or it is running.
  *    - INTERNAL_ERROR      mcu internal error.
 */
@@ -124,6 +221,7 @@ stepper_err_t stepper_uninit(stepper_t const * stepper);
  * @return
  *    - SUCCESS                 update successfully.
  *    - FREQUENCY_UPDATE_ERROR  frequency error, you can check your speed if it is a valid number and in a valid range.
+ *                              with `config.dual_edge`, one step must not be shorter than `config.pulse_us`.
  *    - DUTY_UPDATE_ERROR       duty error, please check `config.subdivision`, the value of `config.subdivision` usually valid from 3 to 10 micromills.
  *    - INTERNAL_ERROR          mcu internal error.
 */
@@ -156,7 +254,8 @@ stepper_err_t stepper_update_direction(stepper_t const * stepper, bool direction
 stepper_err_t stepper_start(stepper_t const * stepper);
 
 /**
- * @brief stop (pause) motor rotation.
+ * @brief stop (pause) motor rotation. with `config.idle_hold_ms`, the driver keeps holding for that long,
+ *        then the step peripheral is released and the driver de-energized, until the next start.
  * 
  * @param stepper   the instance of device
  * 
@@ -165,3 +264,44 @@ stepper_err_t stepper_start(stepper_t const * stepper);
  *    - INTERNAL_ERROR  mcu internal error.
 */
 stepper_err_t stepper_stop(stepper_t const * stepper);
+
+/**
+ * @brief read the commanded position, i.e. the number of steps emitted since initialized.
+ * 
+ * @param stepper   the instance of device
+ * @param position  output, in steps, positive direction counts up.
+ * 
+ * @return
+ *    - SUCCESS             read successfully.
+ *    - INVALID_PARAMETERS  invalid instance id.
+ *    - INVALID_STATE       this instance is not initialized.
+*/
+stepper_err_t stepper_get_position(stepper_t const * stepper, int32_t * position);
+
+/**
+ * @brief read the latest following error sampled by the closed-loop feedback.
+ * 
+ * @param stepper   the instance of device
+ * @param error     output, commanded position minus encoder position, in steps.
+ * 
+ * @return
+ *    - SUCCESS             read successfully.
+ *    - INVALID_PARAMETERS  invalid instance id.
+ *    - INVALID_STATE       this instance is not initialized, or it runs without encoder.
+*/
+stepper_err_t stepper_get_following_error(stepper_t const * stepper, int32_t * error);
+
+/**
+ * @brief read the low-power idle statistics, see `config.idle_hold_ms`.
+ * 
+ * @param stepper   the instance of device
+ * @param stats     output, time spent idle and measured wake-up latency.
+ * 
+ * @return
+ *    - SUCCESS             read successfully.
+ *    - INVALID_PARAMETERS  invalid instance id.
+ *    - INVALID_STATE       this instance is not initialized.
+*/
+stepper_err_t stepper_get_idle_stats(stepper_t const * stepper, stepper_idle_stats_t * stats);
+
+#endif // STEPPER_H__
@@ -2,9 +2,22 @@
 
 #if defined(MCU_ESP32)
 
+#include "stepper_fixed.h"
+#include "stepper_idle.h"
+#include "stepper_shaper.h"
+#include "stepper_trace.h"
+
 #include "esp_err.h"
+#include "esp_timer.h"
+#include "soc/soc_caps.h"
 #include "driver/ledc.h"
 #include "driver/gpio.h"
+#include "esp_private/periph_ctrl.h"
+#if SOC_PCNT_SUPPORTED
+#include "driver/pulse_cnt.h"
+#endif
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
 #ifdef DEBUG
 #include "esp_log.h"
@@ -12,19 +25,49 @@
 
 #define MAX_SUPPORT_STEPPER_NUMBER 4
 
-#define FREQUENCY_THRESH           (360)
+#define FREQUENCY_THRESH           STEPPER_FREQUENCY_THRESH
+#define FEEDBACK_PERIOD_US         (1000)
 static volatile bool module_installed   = false;
-static volatile uint8_t duty_resolution = LEDC_TIMER_8_BIT;
 
 typedef struct {
   stepper_config_t  config;
   volatile bool     running;
   bool              inited;
+  uint8_t           duty_resolution;  // of its own LEDC timer, follows the frequency band.
+  // input shaping: the API commands go into the shaper, its output drives the LEDC and the track.
+  stepper_shaper_t  shaper;
+  uint32_t          command_hz;
+  bool              command_dir;
+  bool              command_running;
+  // low-power idle: LEDC registers kept at idle entry, written back as they are on wake-up.
+  stepper_idle_t    idle;
+  uint32_t          wake_divider;
+  uint32_t          wake_resolution;
+  uint32_t          wake_duty;
+  uint32_t          applied_hz;       // trimmed step rate the LEDC was last programmed to.
 } state_t;
 
-static volatile state_t states[MAX_SUPPORT_STEPPER_NUMBER];
+static state_t states[MAX_SUPPORT_STEPPER_NUMBER];
+
+// position accounting and closed-loop feedback, guarded by `stepper_feedback_lock`.
+stepper_track_t                 stepper_tracks[MAX_SUPPORT_STEPPER_NUMBER];
+stepper_feedback_t              stepper_feedbacks[MAX_SUPPORT_STEPPER_NUMBER];
+static stepper_t const *        instances[MAX_SUPPORT_STEPPER_NUMBER];
+portMUX_TYPE                    stepper_feedback_lock   = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t       feedback_timer  = NULL;
+static esp_timer_handle_t       shaper_timers[MAX_SUPPORT_STEPPER_NUMBER];
+static esp_timer_handle_t       idle_timers[MAX_SUPPORT_STEPPER_NUMBER];
+static bool                     ledc_released   = false;  // LEDC clock gated, all instances are idle.
+// serializes the rate computation with the LEDC writes, between the API callers and the esp_timer task:
+// the last one to program the output reads the latest track and trim.
+static SemaphoreHandle_t        apply_lock      = NULL;
+static StaticSemaphore_t        apply_lock_buffer;
+#if SOC_PCNT_SUPPORTED
+static pcnt_unit_handle_t       encoders[MAX_SUPPORT_STEPPER_NUMBER];
+static int                      encoder_counts[MAX_SUPPORT_STEPPER_NUMBER];
+#endif
 
-#define LEDC_MODE LEDC_LOW_SPEED_MODE
+#define LEDC_MODE STEPPER_LEDC_MODE
 #define LEDC_CLK  LEDC_USE_APB_CLK
 // LEDC_USE_APB_CLK LEDC_USE_XTAL_CLK
 #define LEDC_DEF(pin_, timer_, channel_, freq_, duty_, duty_res_) {\
@@ -58,16 +101,22 @@ static inline uint32_t to_freq_hz(uint32_t subdivision, uint32_t rpm) {
   uint32_t pulse_per_second = (rpm * subdivision / 60);
   return pulse_per_second;
 }
-static inline uint32_t to_duty(uint32_t freq_hz, uint32_t mini_duty_us) {
-// #define PULSE_WIDTH 6
-#define PULSE_FRAC  ((1 << duty_resolution) * mini_duty_us)
-  uint32_t period_us = PERIOD(freq_hz);
-  if (period_us > PULSE_FRAC) return 2;
 
-  uint32_t duty = PULSE_FRAC / period_us;
-  if (duty > (1 << duty_resolution)) duty = (1 << duty_resolution) - 1;
-
-  return duty;
+// dual-edge: the LEDC runs at half of the step rate with 50% duty, every edge is a step.
+static inline uint32_t to_out_hz(stepper_config_t const * config, uint32_t freq_hz) {
+  return config->dual_edge ? freq_hz / 2 : freq_hz;
+}
+static inline uint32_t to_out_duty(state_t const * state, uint32_t out_hz) {
+  return state->config.dual_edge ? (1 << (state->duty_resolution - 1))
+                                 : stepper_ledc_duty(out_hz, state->config.pulse_us, state->duty_resolution);
+}
+// dual-edge: only even step rates are produced, the position accounting keeps to them.
+static inline uint32_t to_step_hz(stepper_config_t const * config, uint32_t freq_hz) {
+  return config->dual_edge ? freq_hz & ~1u : freq_hz;
+}
+// dual-edge: every level lasts one step, so a step must not be shorter than `pulse_us`.
+static inline uint32_t max_step_hz(stepper_config_t const * config) {
+  return (config->dual_edge && config->pulse_us) ? 1000000 / config->pulse_us : UINT32_MAX;
 }
 
 static int update_gpio_config() {
@@ -79,6 +128,9 @@ static int update_gpio_config() {
       if (states[i].config.pin_pulse > -1) {
         pin_mask |= 1ULL << (states[i].config.pin_pulse);
       }
+      if (states[i].config.pin_enable > -1) {
+        pin_mask |= 1ULL << (states[i].config.pin_enable);
+      }
     }
     gpio_config_t io_conf = {
         .pin_bit_mask   = pin_mask,
@@ -101,13 +153,306 @@ static int update_gpio_config() {
     return 0;
 }
 
+#if SOC_PCNT_SUPPORTED
+// x4 quadrature decoding on two PCNT channels, accumulated beyond the 16-bit hardware limits.
+#define ENCODER_LIMIT 32767
+
+// release a unit that failed to configure, so the next `stepper_init` finds it free.
+static void encoder_free(pcnt_unit_handle_t unit, pcnt_channel_handle_t chan_a, pcnt_channel_handle_t chan_b, bool enabled) {
+  if (enabled) pcnt_unit_disable(unit);
+  pcnt_unit_remove_watch_point(unit, ENCODER_LIMIT);   // fails when not added yet, nothing to do then.
+  pcnt_unit_remove_watch_point(unit, -ENCODER_LIMIT);
+  if (chan_a)  pcnt_del_channel(chan_a);
+  if (chan_b)  pcnt_del_channel(chan_b);
+  pcnt_del_unit(unit);
+}
+
+static int encoder_config(stepper_t const * stepper, stepper_config_t const * config) {
+  pcnt_unit_config_t unit_config = {
+    .low_limit  = -ENCODER_LIMIT,
+    .high_limit = ENCODER_LIMIT,
+    .flags.accum_count = 1,
+  };
+  pcnt_unit_handle_t unit = NULL;
+  if (pcnt_new_unit(&unit_config, &unit) != ESP_OK) return -1;
+
+  pcnt_glitch_filter_config_t filter_config = { .max_glitch_ns = 1000, };
+  pcnt_unit_set_glitch_filter(unit, &filter_config);
+
+  pcnt_chan_config_t chan_a_config = { .edge_gpio_num = config->pin_enc_a, .level_gpio_num = config->pin_enc_b, };
+  pcnt_chan_config_t chan_b_config = { .edge_gpio_num = config->pin_enc_b, .level_gpio_num = config->pin_enc_a, };
+  pcnt_channel_handle_t chan_a = NULL;
+  pcnt_channel_handle_t chan_b = NULL;
+  if (pcnt_new_channel(unit, &chan_a_config, &chan_a) != ESP_OK ||
+      pcnt_new_channel(unit, &chan_b_config, &chan_b) != ESP_OK) {
+    encoder_free(unit, chan_a, chan_b, false);
+    return -1;
+  }
+  pcnt_channel_set_edge_action(chan_a, PCNT_CHANNEL_EDGE_ACTION_DECREASE, PCNT_CHANNEL_EDGE_ACTION_INCREASE);
+  pcnt_channel_set_level_action(chan_a, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+  pcnt_channel_set_edge_action(chan_b, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_DECREASE);
+  pcnt_channel_set_level_action(chan_b, PCNT_CHANNEL_LEVEL_ACTION_KEEP, PCNT_CHANNEL_LEVEL_ACTION_INVERSE);
+
+  pcnt_unit_add_watch_point(unit, ENCODER_LIMIT);
+  pcnt_unit_add_watch_point(unit, -ENCODER_LIMIT);
+
+  if (pcnt_unit_enable(unit) != ESP_OK) {
+    encoder_free(unit, chan_a, chan_b, false);
+    return -1;
+  }
+  if (pcnt_unit_clear_count(unit) != ESP_OK || pcnt_unit_start(unit) != ESP_OK) {
+    encoder_free(unit, chan_a, chan_b, true);
+    return -1;
+  }
+
+  encoders[stepper->instance_id]       = unit;
+  encoder_counts[stepper->instance_id] = 0;
+  return 0;
+}
+#endif
+
+int64_t stepper_now_us(void)
+{
+  return esp_timer_get_time();
+}
+
+static stepper_err_t apply_freq(stepper_t const * stepper, uint32_t freq);
+static void trace_period(stepper_t const * stepper, bool restart);
+
+// fixed rate sampling of the following error, dispatched from the esp_timer task.
+static void feedback_handler(void * arg) {
+  int64_t now_us = esp_timer_get_time();
+  for (int i = 0; i < MAX_SUPPORT_STEPPER_NUMBER; i++) {
+    if (stepper_feedbacks[i].cpr == 0) continue;
+    int32_t delta = 0;
+#if SOC_PCNT_SUPPORTED
+    int count = 0;
+    pcnt_unit_get_count(encoders[i], &count);
+    delta = count - encoder_counts[i];
+    encoder_counts[i] = count;
+#endif
+    xSemaphoreTake(apply_lock, portMAX_DELAY);
+    portENTER_CRITICAL(&stepper_feedback_lock);
+    stepper_feedback_action_t action = stepper_feedback_sample(&stepper_feedbacks[i], &stepper_tracks[i], now_us, delta);
+    uint32_t freq   = stepper_feedback_freq(&stepper_feedbacks[i], &stepper_tracks[i]);
+    bool     running = stepper_tracks[i].running;
+    int32_t  error  = stepper_feedbacks[i].error;
+    int32_t  trim   = stepper_feedbacks[i].trim_hz;
+    portEXIT_CRITICAL(&stepper_feedback_lock);
+    // re-applied whenever the output is off the trimmed rate, not only when the trim changed: a trim
+    // held at its bound, or turned by a direction change, is programmed as well.
+    if (action != FEEDBACK_STALL && running && freq && freq != states[i].applied_hz) {  // never resume a stopped output.
+      apply_freq(instances[i], freq);
+    }
+    xSemaphoreGive(apply_lock);
+
+    stepper_event_handler_t handler = states[i].config.event_handler;
+    if (action == FEEDBACK_TRIM && running && freq) {
+      TRACE_FEEDBACK(i, now_us, trim ? STEPPER_EVENT_CORRECTION : STEPPER_EVENT_RECOVERED, error);
+      if (handler) handler(instances[i], trim ? STEPPER_EVENT_CORRECTION : STEPPER_EVENT_RECOVERED, error);
+    } else if (action == FEEDBACK_STALL) {
+      portENTER_CRITICAL(&stepper_feedback_lock);
+      stepper_shaper_reset(&states[i].shaper, 0);  // halt at once, without the shaped ramp down.
+      portEXIT_CRITICAL(&stepper_feedback_lock);
+      stepper_stop(instances[i]);
+      TRACE_FEEDBACK(i, now_us, STEPPER_EVENT_STALL, error);
+      if (handler) handler(instances[i], STEPPER_EVENT_STALL, error);
+    }
+  }
+}
+
+static inline void write_enable(state_t const * state, bool enable) {
+  if (state->config.pin_enable > -1) {
+    gpio_ll_set_level(&GPIO, state->config.pin_enable, enable == state->config.enable_active_high ? 1 : 0);
+  }
+}
+
+/**
+ * hold time expired: keep the LEDC registers, then de-energize the driver and release the LEDC.
+ * one critical section with `idle_wake`: a wake-up either comes before and finds the output running,
+ * or after and finds `ledc_released` set together with the gated clock.
+*/
+static void idle_handler(void * arg) {
+  stepper_t const * stepper = (stepper_t const *) arg;
+  state_t * state = &states[stepper->instance_id];
+  ledc_dev_t *   hw      = LEDC_LL_GET_HW();
+  ledc_channel_t channel = CHANNEL_IDX(stepper);
+
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  if (stepper_tracks[stepper->instance_id].running || state->idle.idle) {
+    portEXIT_CRITICAL(&stepper_feedback_lock);
+    return;  // restarted meanwhile.
+  }
+  ledc_ll_get_clock_divider(hw, LEDC_MODE, TIMER_IDX(stepper), &state->wake_divider);
+  ledc_ll_get_duty_resolution(hw, LEDC_MODE, TIMER_IDX(stepper), &state->wake_resolution);
+  ledc_ll_get_duty(hw, LEDC_MODE, channel, &state->wake_duty);
+  stepper_idle_enter(&state->idle, esp_timer_get_time());
+
+  write_enable(state, false);  // first, so the driver ignores the edge of the released output.
+  ledc_ll_set_idle_level(hw, LEDC_MODE, channel, 0);
+  ledc_ll_set_sig_out_en(hw, LEDC_MODE, channel, false);
+  ledc_ll_ls_channel_update(hw, LEDC_MODE, channel);
+
+  bool all_idle = true;
+  for (int i = 0; i < MAX_SUPPORT_STEPPER_NUMBER; i++) {
+    if (states[i].inited && !states[i].idle.idle) all_idle = false;
+  }
+  if (all_idle && !ledc_released) {
+    ledc_released = true;
+    periph_module_disable(PERIPH_LEDC_MODULE);
+  }
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+}
+
+static void idle_arm(stepper_t const * stepper) {
+  if (idle_timers[stepper->instance_id] == NULL) return;
+  esp_timer_stop(idle_timers[stepper->instance_id]); // fails when not armed, nothing to do then.
+  esp_timer_start_once(idle_timers[stepper->instance_id], states[stepper->instance_id].idle.hold_us);
+}
+
+/**
+ * leave idle before the step output is programmed: a fixed sequence of register writes, no clock or
+ * divider computation. the timer is left paused, the caller resumes it and calls `stepper_idle_woken`.
+ * returns `true` when it woke up, the timer period starts over then.
+*/
+static bool idle_wake(stepper_t const * stepper) {
+  state_t * state = &states[stepper->instance_id];
+  if (idle_timers[stepper->instance_id] == NULL) return false;
+  esp_timer_stop(idle_timers[stepper->instance_id]);
+
+  ledc_dev_t *   hw       = LEDC_LL_GET_HW();
+  ledc_timer_t   timer    = TIMER_IDX(stepper);
+  ledc_channel_t channel  = CHANNEL_IDX(stepper);
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  if (!stepper_idle_wake(&state->idle, esp_timer_get_time())) {
+    portEXIT_CRITICAL(&stepper_feedback_lock);
+    return false;
+  }
+  if (ledc_released) {
+    ledc_released = false;
+    periph_module_enable(PERIPH_LEDC_MODULE);  // registers of every instance are reset.
+  }
+  ledc_ll_set_slow_clk_sel(hw, LEDC_SLOW_CLK_APB);
+  ledc_ll_set_clock_divider(hw, LEDC_MODE, timer, state->wake_divider);
+  ledc_ll_set_duty_resolution(hw, LEDC_MODE, timer, state->wake_resolution);
+  ledc_ll_set_clock_source(hw, LEDC_MODE, timer, LEDC_APB_CLK);
+  ledc_ll_ls_timer_update(hw, LEDC_MODE, timer);
+  ledc_ll_timer_rst(hw, LEDC_MODE, timer);
+  ledc_ll_timer_pause(hw, LEDC_MODE, timer);
+  ledc_ll_bind_channel_timer(hw, LEDC_MODE, channel, timer);
+  ledc_ll_set_hpoint(hw, LEDC_MODE, channel, 0);
+  ledc_ll_set_duty_int_part(hw, LEDC_MODE, channel, state->wake_duty);
+  ledc_ll_set_duty_direction(hw, LEDC_MODE, channel, LEDC_DUTY_DIR_INCREASE);
+  ledc_ll_set_duty_num(hw, LEDC_MODE, channel, 1);
+  ledc_ll_set_duty_cycle(hw, LEDC_MODE, channel, 1);
+  ledc_ll_set_duty_scale(hw, LEDC_MODE, channel, 0);
+  ledc_ll_set_sig_out_en(hw, LEDC_MODE, channel, true);
+  ledc_ll_set_duty_start(hw, LEDC_MODE, channel, true);
+  ledc_ll_ls_channel_update(hw, LEDC_MODE, channel);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+  write_enable(state, true);
+  return true;
+}
+
+static int idle_config(stepper_t const * stepper) {
+  if (idle_timers[stepper->instance_id] != NULL) return 0;
+  const esp_timer_create_args_t timer_args = {
+    .callback = idle_handler,
+    .arg      = (void *) stepper,
+    .name     = "stepper_idle",
+  };
+  return esp_timer_create(&timer_args, &idle_timers[stepper->instance_id]) == ESP_OK ? 0 : -1;
+}
+
+// emit the shaped velocity from now on, and wake up for its next change.
+static void shaper_apply(stepper_t const * stepper) {
+  state_t * state = &states[stepper->instance_id];
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+
+  xSemaphoreTake(apply_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  int64_t  now_us    = esp_timer_get_time();
+  int64_t  next_us   = 0;
+  bool     pending   = stepper_shaper_next(&state->shaper, now_us, &next_us);
+  int32_t  velocity  = stepper_shaper_output(&state->shaper, now_us);
+  uint32_t freq      = to_step_hz(&state->config, velocity < 0 ? -velocity : velocity);
+  bool     running   = freq >= 10;  // same lower bound as `stepper_update_rpm`.
+  bool     direction = velocity ? velocity > 0 : track->direction;
+  bool     turned    = direction != track->direction;
+  stepper_track_set(track, now_us, running ? freq : track->freq_hz, direction, running);
+  if (!running) {
+    stepper_feedbacks[stepper->instance_id].trim_hz = 0;
+  }
+  freq = stepper_feedback_freq(&stepper_feedbacks[stepper->instance_id], track);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+
+  if (turned) {
+    gpio_set_level(state->config.pin_dir, direction ? 1 : 0);
+  }
+  if (running) {
+    apply_freq(stepper, freq);
+  } else if (!state->idle.idle) {
+    ledc_timer_pause(LEDC_MODE, TIMER_IDX(stepper));
+    TRACE_RATE(stepper->instance_id, now_us, 0, direction, false);
+    idle_arm(stepper);
+  }
+
+  esp_timer_stop(shaper_timers[stepper->instance_id]); // fails when not armed, nothing to do then.
+  if (pending) {
+    esp_timer_start_once(shaper_timers[stepper->instance_id], next_us - now_us);
+  }
+  xSemaphoreGive(apply_lock);
+}
+
+static void shaper_handler(void * arg) {
+  shaper_apply((stepper_t const *) arg);
+}
+
+static void shaper_command(stepper_t const * stepper) {
+  state_t * state = &states[stepper->instance_id];
+  int32_t velocity = state->command_running ? (int32_t) state->command_hz : 0;
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  stepper_shaper_input(&state->shaper, esp_timer_get_time(), state->command_dir ? velocity : -velocity);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+  shaper_apply(stepper);
+}
+
+static int shaper_config(stepper_t const * stepper) {
+  if (shaper_timers[stepper->instance_id] != NULL) return 0;
+  const esp_timer_create_args_t timer_args = {
+    .callback = shaper_handler,
+    .arg      = (void *) stepper,
+    .name     = "stepper_shaper",
+  };
+  return esp_timer_create(&timer_args, &shaper_timers[stepper->instance_id]) == ESP_OK ? 0 : -1;
+}
+
+static int feedback_config(stepper_t const * stepper, stepper_config_t const * config) {
+#if SOC_PCNT_SUPPORTED
+  if (encoder_config(stepper, config)) return -1;
+#else
+  return -1; // no hardware quadrature counter on this chip.
+#endif
+  if (feedback_timer == NULL) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = feedback_handler,
+      .name     = "stepper_feedback",
+    };
+    if (esp_timer_create(&timer_args, &feedback_timer) != ESP_OK) return -1;
+    if (esp_timer_start_periodic(feedback_timer, FEEDBACK_PERIOD_US) != ESP_OK) return -1;
+  }
+  return 0;
+}
+
 stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * config)
 {
   if (!module_installed) {
+    apply_lock = xSemaphoreCreateMutexStatic(&apply_lock_buffer);
     for (int i = 0; i < MAX_SUPPORT_STEPPER_NUMBER; i++) {
       if (stepper->instance_id == i) continue;
       states[i].config.pin_dir    = -1;
       states[i].config.pin_pulse  = -1;
+      states[i].config.pin_enable = -1;
       states[i].config.subdivision = 3200;
       states[i].config.rpm        = 1;    // RPM
       states[i].config.direction  = false;
@@ -116,47 +461,89 @@ stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * c
     module_installed = true;
   }
 
-  if (stepper->instance_id > MAX_SUPPORT_STEPPER_NUMBER) {
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
     return INVALID_PARAMETERS;
   }
-  if (states[stepper->instance_id].inited) {
+  state_t * state = &states[stepper->instance_id];
+  if (state->inited) {
     return INVALID_STATE;  // Stepper is already inited.
   }
-  if (states[stepper->instance_id].running) {
+  if (state->running) {
     return INVALID_STATE;  // Invalid State, still working.
   }
-  states[stepper->instance_id].config.pin_dir     = config->pin_dir;
-  states[stepper->instance_id].config.pin_pulse   = config->pin_pulse;
-  states[stepper->instance_id].config.subdivision = config->subdivision;
-  states[stepper->instance_id].config.rpm         = config->rpm > 0 ? config->rpm : 1;
-  states[stepper->instance_id].config.direction   = config->direction;
-  states[stepper->instance_id].config.pulse_us    = config->pulse_us;
+  if (stepper_shaper_init(&state->shaper, config->shaper, config->shaper_freq_hz, config->shaper_damping) != SUCCESS) {
+    return INVALID_PARAMETERS;
+  }
+  if (stepper_idle_init(&state->idle, config) != SUCCESS) {
+    return INVALID_PARAMETERS;
+  }
+  state->config.pin_dir     = config->pin_dir;
+  state->config.pin_pulse   = config->pin_pulse;
+  state->config.subdivision = config->subdivision;
+  state->config.rpm         = config->rpm > 0 ? config->rpm : 1;
+  state->config.direction   = config->direction;
+  state->config.pulse_us    = config->pulse_us;
+  state->config.dual_edge   = config->dual_edge;
+  state->config.pin_enable  = config->pin_enable;
+  state->config.enable_active_high = config->enable_active_high;
+  state->config.event_handler = config->event_handler;
+
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  if (ledc_released) {
+    ledc_released = false;
+    periph_module_enable(PERIPH_LEDC_MODULE);  // the idle instances write their registers back on wake-up.
+  }
+  portEXIT_CRITICAL(&stepper_feedback_lock);
 
   int err = update_gpio_config();
   if (err) {
     return INVALID_PARAMETERS; // GPIO config fail.
   }
+  gpio_set_level(config->pin_dir, config->direction ? 1 : 0);
+  write_enable(state, true);
 
-  uint32_t freq = to_freq_hz(states[stepper->instance_id].config.subdivision, states[stepper->instance_id].config.rpm);
-  uint32_t duty = to_duty(freq, states[stepper->instance_id].config.pulse_us);
+  uint32_t freq = to_step_hz(&state->config, to_freq_hz(state->config.subdivision, state->config.rpm));
+  uint32_t out  = to_out_hz(&state->config, freq);
+  state->duty_resolution = (out > FREQUENCY_THRESH) ? LEDC_TIMER_8_BIT : LEDC_TIMER_14_BIT;
+  uint32_t duty = to_out_duty(state, out);
+  state->command_hz       = freq;
+  state->command_dir      = config->direction;
+  state->command_running  = false;
 
 #ifdef DEBUG
   ESP_LOGI("[Stepper]", "Parameters: freq=%lu, duty=%lu", freq, duty);
 #endif
 
-  duty_resolution = (freq > FREQUENCY_THRESH) ? LEDC_TIMER_8_BIT : LEDC_TIMER_14_BIT;
   LEDC_DEF(
             config->pin_pulse,
             TIMER_IDX(stepper),
             CHANNEL_IDX(stepper),
-            freq,
+            out,
             duty,
-            duty_resolution
+            state->duty_resolution
           );
 
   // ledc_timer_pause(LEDC_MODE, TIMER_IDX(stepper)); // pause after initialized success.
 
-  states[stepper->instance_id].inited = true;
+  instances[stepper->instance_id] = stepper;
+  stepper_feedback_init(&stepper_feedbacks[stepper->instance_id], config, FEEDBACK_PERIOD_US);
+  stepper_track_set(&stepper_tracks[stepper->instance_id], esp_timer_get_time(), freq, config->direction, false);
+  TRACE_CONFIG(stepper->instance_id, esp_timer_get_time(), config);
+  TRACE_API(TRACE_DIRECTION, stepper->instance_id, esp_timer_get_time(), config->direction, 0);
+  if (stepper_feedbacks[stepper->instance_id].cpr) {
+    if (feedback_config(stepper, config)) {
+      stepper_feedbacks[stepper->instance_id].cpr = 0;
+      return INVALID_PARAMETERS; // encoder config fail.
+    }
+  }
+  if (state->shaper.count && shaper_config(stepper)) {
+    return INTERNAL_ERROR;
+  }
+  if (state->idle.hold_us && idle_config(stepper)) {
+    return INTERNAL_ERROR;
+  }
+
+  state->inited = true;
 
   return SUCCESS;
 }
@@ -166,20 +553,57 @@ stepper_err_t stepper_uninit(stepper_t const * stepper)
   return SUCCESS;
 }
 
-stepper_err_t stepper_update_rpm(stepper_t const * stepper, uint32_t rpm)
+stepper_err_t stepper_update_rpm(stepper_t const * stepper, float rpm)
 {
-  esp_err_t err = ESP_OK;
+  state_t * state = &states[stepper->instance_id];
 
-  ledc_timer_t   timer    = TIMER_IDX(stepper);
-  ledc_channel_t channel  = CHANNEL_IDX(stepper);
+  TRACE_API(TRACE_RPM, stepper->instance_id, esp_timer_get_time(), (int32_t)(rpm * 1000), 0);
 
-  uint32_t freq = to_freq_hz(states[stepper->instance_id].config.subdivision, rpm);
+  uint32_t freq = to_step_hz(&state->config, to_freq_hz(state->config.subdivision, rpm));
 
   if (freq < 10) {
     return stepper_stop(stepper);
   }
+  if (freq > max_step_hz(&state->config)) {
+    return FREQUENCY_UPDATE_ERROR;  // dual-edge levels would be shorter than `pulse_us`.
+  }
+
+  if (state->shaper.count) {
+    state->command_hz      = freq;
+    state->command_running = true;
+    shaper_command(stepper);
+    return SUCCESS;
+  }
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  xSemaphoreTake(apply_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  stepper_track_set(track, esp_timer_get_time(), freq, track->direction, true);
+  freq = stepper_feedback_freq(&stepper_feedbacks[stepper->instance_id], track);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+
+  stepper_err_t err = apply_freq(stepper, freq);
+  xSemaphoreGive(apply_lock);
+  return err;
+}
+
+static stepper_err_t apply_freq(stepper_t const * stepper, uint32_t freq)
+{
+  state_t * state = &states[stepper->instance_id];
+
+  esp_err_t err = ESP_OK;
+
+  ledc_timer_t   timer    = TIMER_IDX(stepper);
+  ledc_channel_t channel  = CHANNEL_IDX(stepper);
+
+  state->applied_hz = freq;
+  if (freq > max_step_hz(&state->config)) {
+    freq = max_step_hz(&state->config);  // trimmed by the feedback beyond the limit.
+  }
+  bool restart = idle_wake(stepper);
+  freq = to_out_hz(&state->config, freq);
 
-  uint32_t duty = to_duty(freq, states[stepper->instance_id].config.pulse_us);
+  uint32_t duty = to_out_duty(state, freq);
 
 #ifdef DEBUG
   ESP_LOGI("[Stepper/stepper_update_rpm]", "Parameters: freq=%lu, duty=%lu", freq, duty);
@@ -191,18 +615,22 @@ stepper_err_t stepper_update_rpm(stepper_t const * stepper, uint32_t rpm)
 #endif
   if ((freq_old > FREQUENCY_THRESH) != (freq > FREQUENCY_THRESH)) {
     // update duty_resolution. (reconfig all)
-    duty_resolution = (freq > FREQUENCY_THRESH) ? LEDC_TIMER_8_BIT : LEDC_TIMER_14_BIT;
+    state->duty_resolution = (freq > FREQUENCY_THRESH) ? LEDC_TIMER_8_BIT : LEDC_TIMER_14_BIT;
     ledc_timer_pause(LEDC_MODE, timer);
     ledc_timer_config_t ledc_timer = {
       .speed_mode       = LEDC_MODE,
-      .duty_resolution  = duty_resolution,
+      .duty_resolution  = state->duty_resolution,
       .timer_num        = timer,
       .freq_hz          = freq,
       .clk_cfg          = LEDC_CLK
     };
     ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));    
+    // duty in units of the new resolution.
+    ledc_set_duty(LEDC_MODE, channel, to_out_duty(state, freq));
+    ledc_update_duty(LEDC_MODE, channel);
     ledc_timer_rst(LEDC_MODE, timer);
     ledc_timer_resume(LEDC_MODE, timer);
+    restart = true;
   } else {
     ledc_timer_pause(LEDC_MODE, timer);
     err = ledc_set_freq(LEDC_MODE, timer, freq);
@@ -222,15 +650,48 @@ stepper_err_t stepper_update_rpm(stepper_t const * stepper, uint32_t rpm)
     ledc_timer_resume(LEDC_MODE, timer);
   }
 
+  trace_period(stepper, restart);
+  stepper_idle_woken(&state->idle, esp_timer_get_time());
+
   return SUCCESS;
 }
 
+// trace the period the timer really produces: read back, as `ledc_set_freq` rounds its own divider.
+static void trace_period(stepper_t const * stepper, bool restart) {
+#if defined(STEPPER_TRACE)
+  state_t const * state = &states[stepper->instance_id];
+  uint32_t divider = 0;
+  ledc_ll_get_clock_divider(LEDC_LL_GET_HW(), LEDC_MODE, TIMER_IDX(stepper), &divider);
+  // the traced period is between two steps, i.e. half of the LEDC period in dual-edge mode.
+  uint32_t period_ns = stepper_ledc_period_ns(divider, state->duty_resolution);
+  TRACE_RATE(stepper->instance_id, esp_timer_get_time(), state->config.dual_edge ? period_ns / 2 : period_ns,
+             stepper_tracks[stepper->instance_id].direction, restart);
+#endif
+}
+
 stepper_err_t stepper_update_direction(stepper_t const * stepper, bool direction)
 {
-  esp_err_t err = gpio_set_level(states[stepper->instance_id].config.pin_dir, direction ? 1 : 0);
+  state_t * state = &states[stepper->instance_id];
+
+  if (state->shaper.count) {
+    TRACE_API(TRACE_DIRECTION, stepper->instance_id, esp_timer_get_time(), direction, 0);
+    state->command_dir = direction;
+    shaper_command(stepper);  // the pin turns when the shaped velocity does.
+    return SUCCESS;
+  }
+
+  esp_err_t err = gpio_set_level(state->config.pin_dir, direction ? 1 : 0);
   if (err != ESP_OK) {
-    return INTERNEL_ERROR;
+    return INTERNAL_ERROR;
   }
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  stepper_track_set(track, esp_timer_get_time(), track->freq_hz, direction, track->running);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+
+  TRACE_API(TRACE_DIRECTION, stepper->instance_id, esp_timer_get_time(), direction, 0);
+
   return SUCCESS;
 }
 
@@ -238,26 +699,119 @@ stepper_err_t stepper_start(stepper_t const * stepper)
 {
   ledc_timer_t   timer    = TIMER_IDX(stepper);
 
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  xSemaphoreTake(apply_lock, portMAX_DELAY);
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  int64_t now_us = esp_timer_get_time();
+  if (stepper_feedbacks[stepper->instance_id].stalled) {
+    stepper_feedback_rebase(&stepper_feedbacks[stepper->instance_id], track, now_us); // resume from where the motor really is.
+  }
+  if (states[stepper->instance_id].shaper.count) {
+    portEXIT_CRITICAL(&stepper_feedback_lock);
+    xSemaphoreGive(apply_lock);
+    TRACE_API(TRACE_START, stepper->instance_id, now_us, 0, 0);
+    states[stepper->instance_id].command_running = true;
+    shaper_command(stepper);
+    return SUCCESS;
+  }
+  stepper_track_set(track, now_us, track->freq_hz, track->direction, true);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+
+  bool restart = idle_wake(stepper);
   esp_err_t err = ledc_timer_resume(LEDC_MODE, timer);
   if (err != ESP_OK) {
-    return INTERNEL_ERROR;
+    xSemaphoreGive(apply_lock);
+    return INTERNAL_ERROR;
   }
-  
+  stepper_idle_woken(&states[stepper->instance_id].idle, esp_timer_get_time());
+  xSemaphoreGive(apply_lock);
+  TRACE_API(TRACE_START, stepper->instance_id, now_us, 0, 0);
+  trace_period(stepper, restart);  // resumed where it was paused, unless the idle released it.
+
   return SUCCESS;
 }
 
 stepper_err_t stepper_stop(stepper_t const * stepper)
 {
+  state_t * state = &states[stepper->instance_id];
+
   ledc_timer_t   timer    = TIMER_IDX(stepper);
 
-  esp_err_t err = ledc_timer_pause(LEDC_MODE, timer);
-  if (err != ESP_OK) {
-    return INTERNEL_ERROR;
+  if (state->shaper.count) {
+    TRACE_API(TRACE_STOP, stepper->instance_id, esp_timer_get_time(), 0, 0);
+    state->command_running = false;
+    shaper_command(stepper);  // the shaped output ramps down after the call, pins are kept.
+    return SUCCESS;
+  }
+
+  xSemaphoreTake(apply_lock, portMAX_DELAY);
+  if (!state->idle.idle) {  // the LEDC may be released already.
+    esp_err_t err = ledc_timer_pause(LEDC_MODE, timer);
+    if (err != ESP_OK) {
+      xSemaphoreGive(apply_lock);
+      return INTERNAL_ERROR;
+    }
+    TRACE_RATE(stepper->instance_id, esp_timer_get_time(), 0, stepper_tracks[stepper->instance_id].direction, false);
+    idle_arm(stepper);
+  }
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  stepper_track_set(track, esp_timer_get_time(), track->freq_hz, false, false);
+  stepper_feedbacks[stepper->instance_id].trim_hz = 0;
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+  xSemaphoreGive(apply_lock);
+
+  gpio_set_level(state->config.pin_dir,   0);
+  gpio_set_level(state->config.pin_pulse, 0);
+
+  int64_t now_us = esp_timer_get_time();
+  TRACE_API(TRACE_STOP, stepper->instance_id, now_us, 0, 0);
+  TRACE_API(TRACE_DIRECTION, stepper->instance_id, now_us, false, 0);  // direction pin is released.
+
+  return SUCCESS;
+}
+
+stepper_err_t stepper_get_position(stepper_t const * stepper, int32_t * position)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (!state->inited) {
+    return INVALID_STATE;
   }
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  *position = stepper_track_position(&stepper_tracks[stepper->instance_id], esp_timer_get_time());
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+  return SUCCESS;
+}
 
-  gpio_set_level(states[stepper->instance_id].config.pin_dir,   0);
-  gpio_set_level(states[stepper->instance_id].config.pin_pulse, 0);
+stepper_err_t stepper_get_following_error(stepper_t const * stepper, int32_t * error)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (!state->inited || stepper_feedbacks[stepper->instance_id].cpr == 0) {
+    return INVALID_STATE;
+  }
+  *error = stepper_feedbacks[stepper->instance_id].error;
+  return SUCCESS;
+}
 
+stepper_err_t stepper_get_idle_stats(stepper_t const * stepper, stepper_idle_stats_t * stats)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (!state->inited) {
+    return INVALID_STATE;
+  }
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  stepper_idle_stats(&state->idle, esp_timer_get_time(), stats);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
   return SUCCESS;
 }
 
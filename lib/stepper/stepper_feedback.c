@@ -0,0 +1,105 @@
+#include "stepper_feedback.h"
+
+#define STEP_FRAC 1000000LL  // phase resolution, 1/1000000 step.
+
+// steps done since `stamp_us` with the part of the next one, in 1/1000000 step, whatever the direction.
+static inline int64_t track_progress(stepper_track_t const * track, int64_t now_us) {
+  if (!track->running || track->freq_hz == 0) return track->phase;
+  // freq_hz * us = 1/1000000 step.
+  return track->phase + (int64_t) track->freq_hz * (now_us - track->stamp_us);
+}
+
+void stepper_track_set(stepper_track_t * track, int64_t now_us, uint32_t freq_hz, bool direction, bool running)
+{
+  int64_t progress = track_progress(track, now_us);
+  int64_t steps    = progress / STEP_FRAC;
+  track->origin   += track->direction ? steps : -steps;
+  track->phase     = (uint32_t)(progress % STEP_FRAC);
+  track->stamp_us  = now_us;
+  track->freq_hz   = freq_hz;
+  track->direction = direction;
+  track->running   = running;
+}
+
+int32_t stepper_track_position(stepper_track_t const * track, int64_t now_us)
+{
+  int64_t steps = track_progress(track, now_us) / STEP_FRAC;
+  return (int32_t)(track->direction ? track->origin + steps : track->origin - steps);
+}
+
+void stepper_feedback_init(stepper_feedback_t * feedback, stepper_config_t const * config, uint32_t period_us)
+{
+  feedback->encoder          = 0;
+  feedback->cpr              = (config->pin_enc_a > -1 && config->pin_enc_b > -1) ? config->encoder_cpr : 0;
+  feedback->subdivision      = config->subdivision;
+  feedback->correction_steps = config->correction_steps;
+  feedback->stall_steps      = config->stall_steps;
+  feedback->period_us        = period_us;
+  feedback->error            = 0;
+  feedback->trim_hz          = 0;
+  feedback->stalled          = false;
+}
+
+static inline int32_t encoder_position(stepper_feedback_t const * feedback) {
+  return (int32_t)(feedback->encoder * feedback->subdivision / feedback->cpr);
+}
+
+stepper_feedback_action_t stepper_feedback_sample(stepper_feedback_t * feedback, stepper_track_t const * track, int64_t now_us, int32_t encoder_delta)
+{
+  if (feedback->cpr == 0) return FEEDBACK_NONE;
+
+  feedback->encoder += encoder_delta;
+  int32_t error = stepper_track_position(track, now_us) - encoder_position(feedback);
+  uint32_t magnitude = error < 0 ? -error : error;
+  feedback->error = error;
+
+  if (feedback->stalled) return FEEDBACK_NONE; // latched until rebased.
+
+  if (feedback->stall_steps && magnitude > feedback->stall_steps) {
+    feedback->stalled = true;
+    feedback->trim_hz = 0;
+    return FEEDBACK_STALL;
+  }
+
+  if (!track->running) {
+    feedback->trim_hz = 0;  // nothing to trim, and nothing to re-apply.
+    return FEEDBACK_NONE;
+  }
+  if (feedback->correction_steps == 0) return FEEDBACK_NONE;
+
+  int32_t trim = 0;
+  // hysteresis: once trimming, keep on until half of the threshold.
+  uint32_t thresh = feedback->trim_hz ? feedback->correction_steps / 2 : feedback->correction_steps;
+  if (track->freq_hz && magnitude > thresh) {
+    int64_t bound = track->freq_hz / 2;
+    int64_t rate  = (int64_t) error * 1000000 / (feedback->period_us * STEPPER_CORRECTION_PERIODS);
+    if (rate >  bound) rate =  bound;
+    if (rate < -bound) rate = -bound;
+    trim = (int32_t) rate;
+  }
+  if (trim == feedback->trim_hz) return FEEDBACK_NONE;
+
+  feedback->trim_hz = trim;
+  return FEEDBACK_TRIM;
+}
+
+uint32_t stepper_feedback_freq(stepper_feedback_t const * feedback, stepper_track_t const * track)
+{
+  // the trim was bounded by the rate it was sampled at, the commanded rate may be lower since.
+  int64_t bound = track->freq_hz / 2;
+  int64_t trim  = track->direction ? feedback->trim_hz : -feedback->trim_hz;
+  if (trim >  bound) trim =  bound;
+  if (trim < -bound) trim = -bound;
+  return (uint32_t)((int64_t) track->freq_hz + trim);
+}
+
+void stepper_feedback_rebase(stepper_feedback_t * feedback, stepper_track_t * track, int64_t now_us)
+{
+  if (feedback->cpr == 0) return;
+  stepper_track_set(track, now_us, track->freq_hz, track->direction, track->running);
+  track->origin     = encoder_position(feedback);
+  track->phase      = 0;
+  feedback->error   = 0;
+  feedback->trim_hz = 0;
+  feedback->stalled = false;
+}
@@ -0,0 +1,77 @@
+#ifndef STEPPER_FEEDBACK_H__
+#define STEPPER_FEEDBACK_H__
+
+#include "stepper.h"
+
+/********************************** position accounting ***********************************/
+
+// for internal use only, shared by all mcu backends, no hardware access in here.
+
+/**
+ * @brief monotonic clock of the backend, in microseconds.
+*/
+int64_t stepper_now_us(void);
+
+typedef struct {
+  int64_t  origin;        // commanded position at `stamp_us`, in steps.
+  uint32_t phase;         // part of the next step done at `stamp_us`, in 1/1000000 step. kept across rate
+                          // and direction changes, as the step output keeps the time to its next edge.
+  int64_t  stamp_us;      // start of current segment.
+  uint32_t freq_hz;       // step rate of current segment.
+  bool     direction;
+  bool     running;
+} stepper_track_t;
+
+/**
+ * @brief start a new segment at `now_us`, the elapsed one is folded into `origin` and `phase`.
+*/
+void stepper_track_set(stepper_track_t * track, int64_t now_us, uint32_t freq_hz, bool direction, bool running);
+
+/**
+ * @brief commanded position at `now_us`, in steps.
+*/
+int32_t stepper_track_position(stepper_track_t const * track, int64_t now_us);
+
+/*********************************** following error **************************************/
+
+#define STEPPER_CORRECTION_PERIODS    8     // trim removes the error over this many sampling periods.
+
+typedef enum {
+  FEEDBACK_NONE = 0,
+  FEEDBACK_TRIM,          // `trim_hz` changed, backend should re-apply its step rate.
+  FEEDBACK_STALL,         // stall detected, backend should stop the motor.
+} stepper_feedback_action_t;
+
+typedef struct {
+  int64_t  encoder;           // accumulated encoder counts.
+  uint32_t cpr;               // 0 means feedback disabled.
+  uint32_t subdivision;
+  uint32_t correction_steps;
+  uint32_t stall_steps;
+  uint32_t period_us;         // fixed sampling period of the backend.
+  int32_t  error;             // latest following error, in steps.
+  int32_t  trim_hz;           // signed rate added to the commanded rate, positive direction counts up.
+  bool     stalled;
+} stepper_feedback_t;
+
+void stepper_feedback_init(stepper_feedback_t * feedback, stepper_config_t const * config, uint32_t period_us);
+
+/**
+ * @brief feed the encoder counts of one period, and update following error / trim.
+ *        constant time, no division on the no-error path besides the encoder scaling.
+ *        a stopped track clears the trim without `FEEDBACK_TRIM`, there is no rate to re-apply.
+*/
+stepper_feedback_action_t stepper_feedback_sample(stepper_feedback_t * feedback, stepper_track_t const * track, int64_t now_us, int32_t encoder_delta);
+
+/**
+ * @brief step rate to emit for `track` with current trim applied, bounded to 1/2 - 3/2 of the current
+ *        commanded rate, so it is 0 only when `track->freq_hz` is.
+*/
+uint32_t stepper_feedback_freq(stepper_feedback_t const * feedback, stepper_track_t const * track);
+
+/**
+ * @brief accept the encoder position as commanded position, i.e. after a stall, and clear the stall flag.
+*/
+void stepper_feedback_rebase(stepper_feedback_t * feedback, stepper_track_t * track, int64_t now_us);
+
+#endif // STEPPER_FEEDBACK_H__
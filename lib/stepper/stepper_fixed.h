@@ -0,0 +1,260 @@
+#ifndef STEPPER_FIXED_H__
+#define STEPPER_FIXED_H__
+
+#include "stepper.h"
+#include "stepper_feedback.h"
+#include "stepper_trace.h"
+
+/**
+ * compile-time specialized instances, open-loop, unshaped and single-edge only.
+ *
+ * declare them in `stepper_config.h` (or by compiler flags) as a list of
+ * `X(idx, pin_dir, pin_pulse, subdivision, pulse_us)`:
+ *
+ *   #define STEPPER_FIXED_INSTANCES(X)   \
+ *     X(0, 1, 2, 3200, 3)                \
+ *     X(1, 4, 5, 3200, 3)
+ *
+ * every entry generates, with `N` as idx:
+ *   - `stepper_fixed_N`                        the instance.
+ *   - `stepper_fixed_N_init()`                 `stepper_init` with the constant config.
+ *   - `stepper_fixed_N_update_rpm(rpm)`        same as `stepper_update_rpm`.
+ *   - `stepper_fixed_N_update_direction(dir)`  same as `stepper_update_direction`.
+ *
+ * pins, peripheral and subdivision are constants in the hot calls, so they compile down to direct
+ * register writes, without any lookup of the instance state. `stepper_fixed_N_update_rpm` falls back
+ * to `stepper_update_rpm` when the motor is stopped or the clock band of the peripheral changes.
+*/
+
+#define STEPPER_INLINE static inline __attribute__((always_inline))
+
+#if defined(MCU_ESP32)
+
+#include "esp_timer.h"
+#include "soc/soc.h"
+#include "soc/gpio_struct.h"
+#include "hal/gpio_ll.h"
+#include "hal/ledc_ll.h"
+#include "driver/ledc.h"
+#include <freertos/FreeRTOS.h>
+
+#define STEPPER_LEDC_MODE         LEDC_LOW_SPEED_MODE
+#define STEPPER_FREQUENCY_THRESH  (360)  // 8 bit duty resolution above, 14 bit below.
+
+extern stepper_track_t  stepper_tracks[];
+extern portMUX_TYPE     stepper_feedback_lock;
+
+STEPPER_INLINE uint32_t stepper_ledc_duty(uint32_t freq_hz, uint32_t mini_duty_us, uint32_t duty_resolution) {
+  uint32_t period_us  = 1000000 / freq_hz;
+  uint32_t pulse_frac = (1 << duty_resolution) * mini_duty_us;
+  if (period_us > pulse_frac) return 2;
+
+  uint32_t duty = pulse_frac / period_us;
+  if (duty > (1 << duty_resolution)) duty = (1 << duty_resolution) - 1;
+
+  return duty;
+}
+
+STEPPER_INLINE uint32_t stepper_ledc_divider(uint32_t freq_hz, uint32_t duty_resolution) {
+  return (uint32_t)(((uint64_t) APB_CLK_FREQ << 8) / ((uint64_t) freq_hz << duty_resolution));
+}
+
+// real step period produced by `divider`, in ns.
+STEPPER_INLINE uint32_t stepper_ledc_period_ns(uint32_t divider, uint32_t duty_resolution) {
+  return (uint32_t)(((uint64_t) divider << duty_resolution) * 1000000000ULL / ((uint64_t) APB_CLK_FREQ << 8));
+}
+
+STEPPER_INLINE stepper_err_t stepper_fixed_update_rpm_(stepper_t const * stepper, uint8_t idx, uint32_t subdivision, uint32_t pulse_us, float rpm)
+{
+  uint32_t freq = (uint32_t) rpm * subdivision / 60;
+  stepper_track_t * track = &stepper_tracks[idx];
+  if (freq < 10 || !track->running || (freq > STEPPER_FREQUENCY_THRESH) != (track->freq_hz > STEPPER_FREQUENCY_THRESH)) {
+    return stepper_update_rpm(stepper, rpm);
+  }
+
+  uint32_t duty_resolution = (freq > STEPPER_FREQUENCY_THRESH) ? LEDC_TIMER_8_BIT : LEDC_TIMER_14_BIT;
+  uint32_t divider = stepper_ledc_divider(freq, duty_resolution);
+  uint32_t duty    = stepper_ledc_duty(freq, pulse_us, duty_resolution);
+
+  ledc_dev_t * hw = LEDC_LL_GET_HW();
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  ledc_ll_set_clock_divider(hw, STEPPER_LEDC_MODE, (ledc_timer_t) idx, divider);
+  ledc_ll_ls_timer_update(hw, STEPPER_LEDC_MODE, (ledc_timer_t) idx);
+  ledc_ll_set_duty_int_part(hw, STEPPER_LEDC_MODE, (ledc_channel_t) idx, duty);
+  ledc_ll_set_duty_start(hw, STEPPER_LEDC_MODE, (ledc_channel_t) idx, true);
+  ledc_ll_ls_channel_update(hw, STEPPER_LEDC_MODE, (ledc_channel_t) idx);
+  int64_t now_us = esp_timer_get_time();
+  stepper_track_set(track, now_us, freq, track->direction, true);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+
+  TRACE_API(TRACE_RPM, idx, now_us, (int32_t)(rpm * 1000), 0);
+  TRACE_RATE(idx, now_us, stepper_ledc_period_ns(divider, duty_resolution), track->direction, false);
+
+  return SUCCESS;
+}
+
+STEPPER_INLINE stepper_err_t stepper_fixed_update_direction_(uint8_t idx, uint32_t pin_dir, bool direction)
+{
+  gpio_ll_set_level(&GPIO, pin_dir, direction ? 1 : 0);
+
+  stepper_track_t * track = &stepper_tracks[idx];
+  portENTER_CRITICAL(&stepper_feedback_lock);
+  int64_t now_us = esp_timer_get_time();
+  stepper_track_set(track, now_us, track->freq_hz, direction, track->running);
+  portEXIT_CRITICAL(&stepper_feedback_lock);
+
+  TRACE_API(TRACE_DIRECTION, idx, now_us, direction, 0);
+
+  return SUCCESS;
+}
+
+#define STEPPER_FIXED_RPM_(idx_, subdivision_, pulse_us_, rpm_) \
+  stepper_fixed_update_rpm_(&stepper_fixed_##idx_, idx_, subdivision_, pulse_us_, rpm_)
+
+#elif defined(MCU_NORDIC_RF)
+
+#include <zephyr.h>
+#include <nrfx_pwm.h>
+#include <hal/nrf_gpio.h>
+
+#define STEPPER_PWM_PERIOD_MAX    262140  // ~4Hz
+#define STEPPER_PWM_PERIOD_MIN    5       // 200kHz
+
+extern stepper_track_t          stepper_tracks[];
+extern nrf_pwm_values_common_t  stepper_seq_values[];
+extern nrf_pwm_clk_t            stepper_pwm_clocks[];
+
+/**
+ * @brief find suitable clock source, and convert `period_us` and `duty_us` into its ticks.
+*/
+STEPPER_INLINE nrf_pwm_clk_t stepper_pwm_clock(uint32_t * period_us, uint32_t * duty_us) {
+  if      (*period_us > 32767) {  *period_us /= 8;   *duty_us /= 8;   return NRF_PWM_CLK_125kHz;  }
+  else if (*period_us >  1000) {                                      return NRF_PWM_CLK_1MHz;    }
+  else                         {  *period_us *= 16;  *duty_us *= 16;  return NRF_PWM_CLK_16MHz;   }
+}
+
+// real step period of `top` ticks, in ns.
+STEPPER_INLINE uint32_t stepper_pwm_period_ns(nrf_pwm_clk_t pwm_clock, uint32_t top) {
+  if      (pwm_clock == NRF_PWM_CLK_125kHz) return top * 8000;
+  else if (pwm_clock == NRF_PWM_CLK_1MHz)   return top * 1000;
+  else                                      return top * 1000 / 16;
+}
+
+STEPPER_INLINE stepper_err_t stepper_fixed_update_rpm_(stepper_t const * stepper, NRF_PWM_Type * pwm, uint8_t idx, uint32_t subdivision, uint32_t pulse_us, float rpm)
+{
+  stepper_track_t * track = &stepper_tracks[idx];
+  if (rpm <= 0 || !track->running) {
+    return stepper_update_rpm(stepper, rpm);
+  }
+  uint32_t period_us = (uint32_t)(1000000L * 60 / (rpm * subdivision));
+  if (period_us > STEPPER_PWM_PERIOD_MAX || period_us < STEPPER_PWM_PERIOD_MIN) {
+    return stepper_update_rpm(stepper, rpm);
+  }
+  uint32_t freq      = 1000000 / period_us;
+  uint32_t duty_us   = pulse_us;
+  nrf_pwm_clk_t pwm_clock = stepper_pwm_clock(&period_us, &duty_us);
+  if (pwm_clock != stepper_pwm_clocks[idx]) {
+    return stepper_update_rpm(stepper, rpm);
+  }
+
+  // the looped sequence picks up the new duty on its next period.
+  unsigned int key = irq_lock();
+  nrf_pwm_configure(pwm, pwm_clock, NRF_PWM_MODE_UP, (uint16_t) period_us);
+  stepper_seq_values[idx] = (nrf_pwm_values_common_t) duty_us;
+  int64_t now_us = k_ticks_to_us_floor64(k_uptime_ticks());
+  stepper_track_set(track, now_us, freq, track->direction, true);
+  irq_unlock(key);
+
+  TRACE_API(TRACE_RPM, idx, now_us, (int32_t)(rpm * 1000), 0);
+  TRACE_RATE(idx, now_us, stepper_pwm_period_ns(pwm_clock, period_us), track->direction, false);
+
+  return SUCCESS;
+}
+
+STEPPER_INLINE stepper_err_t stepper_fixed_update_direction_(uint8_t idx, uint32_t pin_dir, bool direction)
+{
+  nrf_gpio_pin_write(pin_dir, direction ? 1 : 0);
+
+  stepper_track_t * track = &stepper_tracks[idx];
+  unsigned int key = irq_lock();
+  int64_t now_us = k_ticks_to_us_floor64(k_uptime_ticks());
+  stepper_track_set(track, now_us, track->freq_hz, direction, track->running);
+  irq_unlock(key);
+
+  TRACE_API(TRACE_DIRECTION, idx, now_us, direction, 0);
+
+  return SUCCESS;
+}
+
+// PWM instances are numbered as `stepper_init` does, i.e. with all of PWM0..3 enabled.
+#define STEPPER_FIXED_RPM_(idx_, subdivision_, pulse_us_, rpm_) \
+  stepper_fixed_update_rpm_(&stepper_fixed_##idx_, NRFX_CONCAT_2(NRF_PWM, idx_), idx_, subdivision_, pulse_us_, rpm_)
+
+#else
+
+#include "stepper_soft.h"
+
+// soft backend: the mocked step peripheral of `stepper_soft.h`, so both paths can be compared on the host.
+
+STEPPER_INLINE stepper_err_t stepper_fixed_update_rpm_(stepper_t const * stepper, stepper_soft_regs_t * regs, uint8_t idx, uint32_t subdivision, uint32_t pulse_us, float rpm)
+{
+  uint32_t freq = (uint32_t) rpm * subdivision / 60;
+  stepper_track_t * track = &stepper_tracks[idx];
+  if (freq < 10 || !track->running) {
+    return stepper_update_rpm(stepper, rpm);
+  }
+
+  int64_t now_us = stepper_now_us();
+  regs->top  = STEPPER_SOFT_CLOCK_HZ / freq;
+  regs->duty = pulse_us * (STEPPER_SOFT_CLOCK_HZ / 1000000);
+  bool output = stepper_soft_periph_update(idx);  // `false` while waking up from idle.
+  stepper_track_set(track, now_us, freq, track->direction, true);
+
+  TRACE_API(TRACE_RPM, idx, now_us, (int32_t)(rpm * 1000), 0);
+  if (output) {
+    TRACE_RATE(idx, now_us, stepper_soft_period_ns(regs->top), track->direction, false);
+  }
+
+  return SUCCESS;
+}
+
+// the DIR pin of the mocked peripheral is its `dir` register.
+STEPPER_INLINE stepper_err_t stepper_fixed_update_direction_(uint8_t idx, uint32_t pin_dir, bool direction)
+{
+  stepper_soft_periphs[idx].regs.dir = direction;
+  stepper_soft_periph_update(idx);
+
+  stepper_track_t * track = &stepper_tracks[idx];
+  int64_t now_us = stepper_now_us();
+  stepper_track_set(track, now_us, track->freq_hz, direction, track->running);
+
+  TRACE_API(TRACE_DIRECTION, idx, now_us, direction, 0);
+
+  return SUCCESS;
+}
+
+#define STEPPER_FIXED_RPM_(idx_, subdivision_, pulse_us_, rpm_) \
+  stepper_fixed_update_rpm_(&stepper_fixed_##idx_, &stepper_soft_periphs[idx_].regs, idx_, subdivision_, pulse_us_, rpm_)
+
+#endif
+
+#define STEPPER_FIXED_DEFINE_(idx_, pin_dir_, pin_pulse_, subdivision_, pulse_us_)           \
+  static const stepper_t stepper_fixed_##idx_ = STEPPER_INSTANCE(idx_);                       \
+  static inline stepper_err_t stepper_fixed_##idx_##_init(void) {                             \
+    stepper_config_t config = STEPPER_CONFIG(pin_dir_, pin_pulse_);                           \
+    config.subdivision = subdivision_;                                                        \
+    config.pulse_us    = pulse_us_;                                                           \
+    return stepper_init(&stepper_fixed_##idx_, &config);                                      \
+  }                                                                                           \
+  static inline stepper_err_t stepper_fixed_##idx_##_update_rpm(float rpm) {                  \
+    return STEPPER_FIXED_RPM_(idx_, subdivision_, pulse_us_, rpm);                            \
+  }                                                                                           \
+  static inline stepper_err_t stepper_fixed_##idx_##_update_direction(bool direction) {       \
+    return stepper_fixed_update_direction_(idx_, pin_dir_, direction);                        \
+  }
+
+#if defined(STEPPER_FIXED_INSTANCES)
+STEPPER_FIXED_INSTANCES(STEPPER_FIXED_DEFINE_)
+#endif
+
+#endif // STEPPER_FIXED_H__
@@ -0,0 +1,57 @@
+#include "stepper_idle.h"
+
+stepper_err_t stepper_idle_init(stepper_idle_t * idle, stepper_config_t const * config)
+{
+  if (config->idle_hold_ms && config->dual_edge && config->pin_enable < 0) {
+    return INVALID_PARAMETERS;
+  }
+  if (config->idle_hold_ms > STEPPER_IDLE_HOLD_MS_MAX) {
+    return INVALID_PARAMETERS;  // `hold_us` would wrap.
+  }
+  idle->hold_us             = config->idle_hold_ms * 1000;
+  idle->idle                = false;
+  idle->waking              = false;
+  idle->since_us            = 0;
+  idle->wake_us             = 0;
+  idle->idle_us             = 0;
+  idle->wake_count          = 0;
+  idle->wake_latency_us     = 0;
+  idle->wake_latency_max_us = 0;
+  return SUCCESS;
+}
+
+void stepper_idle_enter(stepper_idle_t * idle, int64_t now_us)
+{
+  if (idle->idle) return;
+  idle->idle     = true;
+  idle->since_us = now_us;
+}
+
+bool stepper_idle_wake(stepper_idle_t * idle, int64_t now_us)
+{
+  if (!idle->idle) return false;
+  idle->idle     = false;
+  idle->idle_us += now_us - idle->since_us;
+  idle->wake_us  = now_us;
+  idle->waking   = true;
+  return true;
+}
+
+void stepper_idle_woken(stepper_idle_t * idle, int64_t now_us)
+{
+  if (!idle->waking) return;
+  uint32_t latency = (uint32_t)(now_us - idle->wake_us);
+  idle->waking           = false;
+  idle->wake_count++;
+  idle->wake_latency_us  = latency;
+  if (latency > idle->wake_latency_max_us) idle->wake_latency_max_us = latency;
+}
+
+void stepper_idle_stats(stepper_idle_t const * idle, int64_t now_us, stepper_idle_stats_t * stats)
+{
+  stats->idle_us             = idle->idle_us + (idle->idle ? (uint64_t)(now_us - idle->since_us) : 0);
+  stats->wake_count          = idle->wake_count;
+  stats->wake_latency_us     = idle->wake_latency_us;
+  stats->wake_latency_max_us = idle->wake_latency_max_us;
+  stats->idle                = idle->idle;
+}
@@ -0,0 +1,55 @@
+#ifndef STEPPER_IDLE_H__
+#define STEPPER_IDLE_H__
+
+#include "stepper.h"
+
+/************************************* low-power idle *************************************/
+
+// for internal use only, shared by all mcu backends, no hardware access in here.
+
+/**
+ * the backend arms a one-shot timer of `hold_us` whenever the step output stops, and enters idle
+ * when it expires: step peripheral released and driver de-energized. the next output wakes it up,
+ * the latency is measured from the wake-up call until the step output runs again.
+*/
+
+typedef struct {
+  uint32_t  hold_us;          // 0 means the idle policy is disabled.
+  bool      idle;
+  bool      waking;           // between the wake-up call and the step output.
+  int64_t   since_us;         // idle entry.
+  int64_t   wake_us;          // start of the ongoing wake-up.
+  uint64_t  idle_us;          // completed idle periods.
+  uint32_t  wake_count;
+  uint32_t  wake_latency_us;
+  uint32_t  wake_latency_max_us;
+} stepper_idle_t;
+
+/**
+ * @brief `config.idle_hold_ms` enables the policy.
+ *
+ * @return
+ *    - SUCCESS             valid parameters.
+ *    - INVALID_PARAMETERS  dual-edge without `config.pin_enable`: the output is released at whatever level
+ *                          it stopped, its fall to low would be a step of an energized driver.
+ *                          `config.idle_hold_ms` above `STEPPER_IDLE_HOLD_MS_MAX`.
+*/
+stepper_err_t stepper_idle_init(stepper_idle_t * idle, stepper_config_t const * config);
+
+void stepper_idle_enter(stepper_idle_t * idle, int64_t now_us);
+
+/**
+ * @brief leave idle and start measuring the wake-up latency.
+ *
+ * @return `false` when it was not idle, nothing to re-arm then.
+*/
+bool stepper_idle_wake(stepper_idle_t * idle, int64_t now_us);
+
+/**
+ * @brief the step output runs again, record the latency of the ongoing wake-up, if any.
+*/
+void stepper_idle_woken(stepper_idle_t * idle, int64_t now_us);
+
+void stepper_idle_stats(stepper_idle_t const * idle, int64_t now_us, stepper_idle_stats_t * stats);
+
+#endif // STEPPER_IDLE_H__
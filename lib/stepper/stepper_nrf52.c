@@ -8,7 +8,16 @@
 // #define NRFX_PWM2_ENABLED 1
 // #define NRFX_PWM3_ENABLED 1
 
+#include "stepper_fixed.h"
+#include "stepper_idle.h"
+#include "stepper_shaper.h"
+#include "stepper_trace.h"
+
+#include <zephyr.h>
 #include <nrfx_pwm.h>
+#if NRFX_QDEC_ENABLED
+#include <nrfx_qdec.h>
+#endif
 #include <hal/nrf_gpio.h>
 
 static nrfx_pwm_t const m_pwms[NRFX_PWM_ENABLED_COUNT] = {
@@ -39,20 +48,300 @@ typedef struct {
   stepper_config_t  config;
   volatile bool     running;
   bool              inited;
+  bool              playing;      // the looped sequence runs, its top and duty can be updated in place.
+  bool              configured;   // nrfx initialized with `stepper_pwm_clocks`, its sequence can be restarted.
+  // input shaping: the API commands go into the shaper, its output drives the PWM and the track.
+  stepper_shaper_t  shaper;
+  struct k_timer    shaper_timer;
+  struct k_work     shaper_work;  // the timer expires in ISR context, the PWM is re-programmed from here.
+  uint32_t          command_hz;
+  bool              command_dir;
+  bool              command_running;
+  // low-power idle: the wake-up re-arms the disabled PWM from `stepper_pwm_clocks` and `stepper_seq_values`.
+  stepper_idle_t    idle;
+  struct k_timer    idle_timer;
+  // closed-loop: the QDEC interrupt samples, the strongest action since is handled from `feedback_work`.
+  stepper_feedback_action_t feedback_action;
+  struct k_work     feedback_work;
+  uint32_t          applied_hz;   // trimmed step rate the PWM was last programmed to, 0 when stopped.
 } state_t;
 
-static volatile state_t states[MAX_SUPPORT_STEPPER_NUMBER];
+static state_t states[MAX_SUPPORT_STEPPER_NUMBER];
+
+// duty of the looped sequence, read by PWM EasyDMA every period, so it must outlive the playback.
+nrf_pwm_values_common_t         stepper_seq_values[MAX_SUPPORT_STEPPER_NUMBER];
+nrf_pwm_clk_t                   stepper_pwm_clocks[MAX_SUPPORT_STEPPER_NUMBER];
+
+// position accounting and closed-loop feedback, guarded by `irq_lock`.
+stepper_track_t                 stepper_tracks[MAX_SUPPORT_STEPPER_NUMBER];
+stepper_feedback_t              stepper_feedbacks[MAX_SUPPORT_STEPPER_NUMBER];
+static stepper_t const *        instances[MAX_SUPPORT_STEPPER_NUMBER];
+static int                      encoder_owner = -1;  // only one QDEC peripheral on nRF52.
+// serializes the rate computation with the PWM writes, between the API callers and the workqueue:
+// the last one to program the output reads the latest track and trim.
+static K_MUTEX_DEFINE(apply_lock);
+
+// QDEC reports every 10 samples of 128us, i.e. the fixed sampling rate of the following error.
+// notice that QDEC samples at most one transition per sample period, ~7.8k counts/s.
+#define FEEDBACK_PERIOD_US          (10 * 128)
+
+int64_t stepper_now_us(void)
+{
+  return k_ticks_to_us_floor64(k_uptime_ticks());
+}
 
 static inline uint32_t to_period_us(uint32_t subdivision, float rpm) {
   return (uint32_t)(1000000L * 60 / (rpm * subdivision));
 }
 
+// 0 (no output) for 0Hz.
+static inline uint32_t hz_to_period_us(uint32_t freq_hz) {
+  return freq_hz ? 1000000 / freq_hz : 0;
+}
+
+// dual-edge: one PWM period holds two steps, the STEP line toggles at 50% duty.
+static inline uint32_t to_pwm_period_us(stepper_config_t const * config, uint32_t period_us) {
+  return config->dual_edge ? period_us * 2 : period_us;
+}
+
+static inline bool period_valid(stepper_config_t const * config, uint32_t period_us) {
+  uint32_t pwm_period_us = to_pwm_period_us(config, period_us);
+  if (pwm_period_us > STEPPER_PWM_PERIOD_MAX || pwm_period_us < STEPPER_PWM_PERIOD_MIN) return false;
+  return !config->dual_edge || period_us >= config->pulse_us;  // every level lasts one step.
+}
+
+static stepper_err_t apply_period(stepper_t const * stepper, uint32_t period_us);
+static stepper_err_t trace_period(stepper_t const * stepper, nrf_pwm_clk_t pwm_clock, uint32_t top, bool restart);
+
+static void write_direction(state_t const * state, bool direction) {
+  for (int i = 0; i < 4; i++) {
+    int32_t pin = state->config.pin_dirs[i];
+    if (pin > 0) {
+      if (direction) { nrf_gpio_pin_set(pin); } else { nrf_gpio_pin_clear(pin); }
+    }
+  }
+}
+
+static void write_enable(state_t const * state, bool enable) {
+  if (state->config.pin_enable > -1) {
+    nrf_gpio_pin_write(state->config.pin_enable, enable == state->config.enable_active_high ? 1 : 0);
+  }
+}
+
+// hold time expired: de-energize the driver, and disable the PWM to drop its clock request.
+static void idle_expiry(struct k_timer * timer) {
+  stepper_t const * stepper = (stepper_t const *) k_timer_user_data_get(timer);
+  state_t * state = &states[stepper->instance_id];
+
+  unsigned int key = irq_lock();
+  bool running = stepper_tracks[stepper->instance_id].running;
+  if (!running) {
+    stepper_idle_enter(&state->idle, stepper_now_us());
+  }
+  irq_unlock(key);
+  if (running) return;  // restarted meanwhile.
+
+  write_enable(state, false);
+  nrf_pwm_disable(PWM_INSTANCE(stepper)->p_registers);
+}
+
+static void idle_arm(stepper_t const * stepper) {
+  state_t * state = &states[stepper->instance_id];
+  if (state->idle.hold_us == 0 || state->idle.idle) return;
+  k_timer_start(&state->idle_timer, K_USEC(state->idle.hold_us), K_NO_WAIT);
+}
+
+/**
+ * leave idle before the step output is programmed. with the prescaler of the stopped output, the PWM
+ * is re-armed in place: COUNTERTOP and the stored sequence value take `top` and `duty`, then the looped
+ * sequence restarts, no nrfx re-init. returns `true` when the output runs again, the caller traces it
+ * and calls `stepper_idle_woken`, `false` when it was not idle or needs another prescaler.
+*/
+static bool idle_wake(stepper_t const * stepper, nrf_pwm_clk_t pwm_clock, uint16_t top, uint16_t duty) {
+  state_t * state = &states[stepper->instance_id];
+  if (state->idle.hold_us == 0) return false;
+  k_timer_stop(&state->idle_timer);
+
+  unsigned int key = irq_lock();
+  bool woke = stepper_idle_wake(&state->idle, stepper_now_us());
+  irq_unlock(key);
+  if (!woke) return false;
+
+  const nrfx_pwm_t * instance = PWM_INSTANCE(stepper);
+  nrf_pwm_enable(instance->p_registers);
+  write_enable(state, true);
+  if (!state->configured || pwm_clock != stepper_pwm_clocks[stepper->instance_id]) return false;  // re-initialized by the caller.
+
+  stepper_seq_values[stepper->instance_id] = (nrf_pwm_values_common_t) duty;
+  nrf_pwm_configure(instance->p_registers, pwm_clock, NRF_PWM_MODE_UP, top);
+  nrf_pwm_sequence_t sequence = {
+    .values.p_common = &stepper_seq_values[stepper->instance_id],
+    .length          = 1,
+    .repeats         = 0,
+    .end_delay       = 0,
+  };
+  nrfx_pwm_simple_playback(instance, &sequence, 1, NRFX_PWM_FLAG_LOOP);
+  state->playing = true;
+  return true;
+}
+
+// emit the shaped velocity from now on, and wake up for its next change.
+static void shaper_apply(stepper_t const * stepper) {
+  state_t * state = &states[stepper->instance_id];
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+
+  k_mutex_lock(&apply_lock, K_FOREVER);
+  unsigned int key = irq_lock();
+  int64_t  now_us    = stepper_now_us();
+  int64_t  next_us   = 0;
+  bool     pending   = stepper_shaper_next(&state->shaper, now_us, &next_us);
+  int32_t  velocity  = stepper_shaper_output(&state->shaper, now_us);
+  uint32_t freq      = velocity < 0 ? -velocity : velocity;
+  uint32_t period_us = freq ? 1000000 / freq : 0;
+  bool     running   = period_valid(&state->config, period_us);
+  bool     direction = velocity ? velocity > 0 : track->direction;
+  bool     turned    = direction != track->direction;
+  stepper_track_set(track, now_us, running ? 1000000 / period_us : track->freq_hz, direction, running);
+  if (!running) {
+    stepper_feedbacks[stepper->instance_id].trim_hz = 0;
+  } else if (stepper_feedbacks[stepper->instance_id].trim_hz) {
+    period_us = hz_to_period_us(stepper_feedback_freq(&stepper_feedbacks[stepper->instance_id], track));
+  }
+  state->applied_hz = running ? stepper_feedback_freq(&stepper_feedbacks[stepper->instance_id], track) : 0;
+  irq_unlock(key);
+
+  if (turned) {
+    write_direction(state, direction);
+  }
+  if (running) {
+    apply_period(stepper, period_us);
+  } else {
+    nrfx_pwm_stop(PWM_INSTANCE(stepper), true);
+    state->playing = false;
+    TRACE_RATE(stepper->instance_id, now_us, 0, direction, false);
+    idle_arm(stepper);
+  }
+
+  if (pending) {
+    k_timer_start(&state->shaper_timer, K_USEC(next_us - now_us), K_NO_WAIT);
+  } else {
+    k_timer_stop(&state->shaper_timer);
+  }
+  k_mutex_unlock(&apply_lock);
+}
+
+// `nrfx_pwm_stop` waits for the end of the PWM period, and re-init is not ISR safe: both run on the
+// system workqueue, never from the timer and QDEC interrupts.
+static void shaper_work_handler(struct k_work * work) {
+  state_t * state = CONTAINER_OF(work, state_t, shaper_work);
+  shaper_apply(instances[state - states]);
+}
+
+static void shaper_expiry(struct k_timer * timer) {
+  stepper_t const * stepper = (stepper_t const *) k_timer_user_data_get(timer);
+  k_work_submit(&states[stepper->instance_id].shaper_work);
+}
+
+static void shaper_command(stepper_t const * stepper) {
+  state_t * state = &states[stepper->instance_id];
+  int32_t velocity = state->command_running ? (int32_t) state->command_hz : 0;
+  unsigned int key = irq_lock();
+  stepper_shaper_input(&state->shaper, stepper_now_us(), state->command_dir ? velocity : -velocity);
+  irq_unlock(key);
+  shaper_apply(stepper);
+}
+
+#if NRFX_QDEC_ENABLED
+static void feedback_work_handler(struct k_work * work) {
+  state_t * state = CONTAINER_OF(work, state_t, feedback_work);
+  int i = state - states;
+
+  int64_t now_us = stepper_now_us();
+  k_mutex_lock(&apply_lock, K_FOREVER);
+  unsigned int key = irq_lock();
+  stepper_feedback_action_t action = state->feedback_action;
+  state->feedback_action = FEEDBACK_NONE;
+  uint32_t freq   = stepper_feedback_freq(&stepper_feedbacks[i], &stepper_tracks[i]);
+  bool     running = stepper_tracks[i].running;
+  int32_t  error  = stepper_feedbacks[i].error;
+  int32_t  trim   = stepper_feedbacks[i].trim_hz;
+  irq_unlock(key);
+
+  // re-applied whenever the output is off the trimmed rate, not only when the trim changed: a trim held
+  // at its bound, or turned by a direction change, is programmed as well.
+  if (action != FEEDBACK_STALL && running && freq && freq != state->applied_hz) {  // never restart a stopped output.
+    state->applied_hz = freq;
+    apply_period(instances[i], hz_to_period_us(freq));
+  }
+  k_mutex_unlock(&apply_lock);
+
+  stepper_event_handler_t handler = states[i].config.event_handler;
+  if (action == FEEDBACK_TRIM && running && freq) {
+    TRACE_FEEDBACK(i, now_us, trim ? STEPPER_EVENT_CORRECTION : STEPPER_EVENT_RECOVERED, error);
+    if (handler) handler(instances[i], trim ? STEPPER_EVENT_CORRECTION : STEPPER_EVENT_RECOVERED, error);
+  } else if (action == FEEDBACK_STALL) {
+    key = irq_lock();
+    stepper_shaper_reset(&states[i].shaper, 0);  // halt at once, without the shaped ramp down.
+    irq_unlock(key);
+    stepper_stop(instances[i]);
+    TRACE_FEEDBACK(i, now_us, STEPPER_EVENT_STALL, error);
+    if (handler) handler(instances[i], STEPPER_EVENT_STALL, error);
+  }
+}
+
+// sampled at the fixed rate of the reports, the rate change and the stop are deferred to the workqueue.
+static void qdec_handler(nrfx_qdec_event_t event) {
+  if (event.type != NRF_QDEC_EVENT_REPORTRDY || encoder_owner < 0) return;
+  int i = encoder_owner;
+
+  unsigned int key = irq_lock();
+  stepper_feedback_action_t action = stepper_feedback_sample(&stepper_feedbacks[i], &stepper_tracks[i], stepper_now_us(), event.data.report.acc);
+  if (action > states[i].feedback_action) {
+    states[i].feedback_action = action;  // a stall outweighs a trim not handled yet.
+  }
+  bool off_rate = stepper_tracks[i].running &&
+                  stepper_feedback_freq(&stepper_feedbacks[i], &stepper_tracks[i]) != states[i].applied_hz;
+  irq_unlock(key);
+
+  if (action != FEEDBACK_NONE || off_rate) {
+    k_work_submit(&states[i].feedback_work);
+  }
+}
+#endif
+
+static int feedback_config(stepper_t const * stepper, stepper_config_t const * config) {
+#if NRFX_QDEC_ENABLED
+  if (encoder_owner > -1) return -1; // QDEC is already used by another instance.
+
+  nrfx_qdec_config_t qdec_config = {
+    .reportper          = NRF_QDEC_REPORTPER_10,
+    .sampleper          = NRF_QDEC_SAMPLEPER_128us,
+    .psela              = config->pin_enc_a,
+    .pselb              = config->pin_enc_b,
+    .pselled            = NRF_QDEC_LED_NOT_CONNECTED,
+    .ledpre             = 0,
+    .ledpol             = NRF_QDEC_LEPOL_ACTIVE_HIGH,
+    .dbfen              = true,
+    .sample_inten       = false,
+    .interrupt_priority = PWM_IRQ_PRIORITY,
+  };
+  IRQ_CONNECT(QDEC_IRQn, PWM_IRQ_PRIORITY, nrfx_isr, nrfx_qdec_irq_handler, 0);
+  if (nrfx_qdec_init(&qdec_config, qdec_handler) != NRFX_SUCCESS) return -1;
+
+  encoder_owner = stepper->instance_id;
+  nrfx_qdec_enable();
+  return 0;
+#else
+  return -1; // enable CONFIG_NRFX_QDEC for closed-loop feedback.
+#endif
+}
+
 stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * config)
 {
   if (!module_installed) {
     for (int i = 0; i < MAX_SUPPORT_STEPPER_NUMBER; i++) {
       if (stepper->instance_id == i) continue;
-      for (int k = 0; i < 4; k++) {
+      for (int k = 0; k < 4; k++) {
         states[i].config.pin_dirs[k]    = -1;
         states[i].config.pin_pulses[k]  = -1;
       }
@@ -64,18 +353,25 @@ stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * c
     module_installed = true;
   }
 
-  if (stepper->instance_id > MAX_SUPPORT_STEPPER_NUMBER) {
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
     return INVALID_PARAMETERS;
   }
-  if (states[stepper->instance_id].inited) {
+  state_t * state = &states[stepper->instance_id];
+  if (state->inited) {
     return INVALID_STATE;  // Stepper is already inited.
   }
-  if (states[stepper->instance_id].running) {
+  if (state->running) {
     return INVALID_STATE;  // Invalid State, still working.
   }
+  if (stepper_shaper_init(&state->shaper, config->shaper, config->shaper_freq_hz, config->shaper_damping) != SUCCESS) {
+    return INVALID_PARAMETERS;
+  }
+  if (stepper_idle_init(&state->idle, config) != SUCCESS) {
+    return INVALID_PARAMETERS;
+  }
   for (int i = 0; i < 4; i++) {
-    states[stepper->instance_id].config.pin_dirs[i]     = config->pin_dirs[i];
-    states[stepper->instance_id].config.pin_pulses[i]   = config->pin_pulses[i];
+    state->config.pin_dirs[i]     = config->pin_dirs[i];
+    state->config.pin_pulses[i]   = config->pin_pulses[i];
     // update gpio.
     if (config->pin_dirs[i] > 0) {
       nrf_gpio_cfg(config->pin_dirs[i], NRF_GPIO_PIN_DIR_OUTPUT, NRF_GPIO_PIN_INPUT_DISCONNECT, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_H0H1, NRF_GPIO_PIN_NOSENSE);
@@ -84,54 +380,156 @@ stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * c
       nrf_gpio_cfg(config->pin_pulses[i], NRF_GPIO_PIN_DIR_OUTPUT, NRF_GPIO_PIN_INPUT_DISCONNECT, NRF_GPIO_PIN_NOPULL, NRF_GPIO_PIN_H0H1, NRF_GPIO_PIN_NOSENSE);
     }
   }
-  states[stepper->instance_id].config.subdivision = config->subdivision;
-  states[stepper->instance_id].config.rpm         = config->rpm > 0 ? config->rpm : 1;
-  states[stepper->instance_id].config.direction   = config->direction;
-  states[stepper->instance_id].config.pulse_us    = config->pulse_us;
+  state->config.pin_enable  = config->pin_enable;
+  state->config.enable_active_high = config->enable_active_high;
+  if (config->pin_enable > -1) {
+    nrf_gpio_cfg_output(config->pin_enable);
+    write_enable(state, true);
+  }
+  state->config.subdivision = config->subdivision;
+  state->config.rpm         = config->rpm > 0 ? config->rpm : 1;
+  state->config.direction   = config->direction;
+  state->config.pulse_us    = config->pulse_us;
+  state->config.dual_edge   = config->dual_edge;
+  state->config.event_handler = config->event_handler;
+  state->command_dir        = config->direction;
+  k_timer_init(&state->shaper_timer, shaper_expiry, NULL);
+  k_timer_user_data_set(&state->shaper_timer, (void *) stepper);
+  k_work_init(&state->shaper_work, shaper_work_handler);
+#if NRFX_QDEC_ENABLED
+  state->feedback_action = FEEDBACK_NONE;
+  k_work_init(&state->feedback_work, feedback_work_handler);
+#endif
+  k_timer_init(&state->idle_timer, idle_expiry, NULL);
+  k_timer_user_data_set(&state->idle_timer, (void *) stepper);
+
+  instances[stepper->instance_id] = stepper;
+  stepper_feedback_init(&stepper_feedbacks[stepper->instance_id], config, FEEDBACK_PERIOD_US);
+  stepper_track_set(&stepper_tracks[stepper->instance_id], stepper_now_us(), 0, config->direction, false);
+  TRACE_CONFIG(stepper->instance_id, stepper_now_us(), config);
+  if (stepper_feedbacks[stepper->instance_id].cpr) {
+    if (feedback_config(stepper, config)) {
+      stepper_feedbacks[stepper->instance_id].cpr = 0;
+      return INVALID_PARAMETERS; // encoder config fail.
+    }
+  }
 
-  stepper_err_t err = stepper_update_rpm(stepper, states[stepper->instance_id].config.rpm);
+  stepper_err_t err = stepper_update_rpm(stepper, state->config.rpm);
   if (err != SUCCESS) { return err; }
 
-  err = stepper_update_direction(stepper, states[stepper->instance_id].config.direction);
+  err = stepper_update_direction(stepper, state->config.direction);
   if (err != SUCCESS) { return err; }
 
-  states[stepper->instance_id].inited = true;
+  state->inited = true;
 
   return SUCCESS;
 }
 
 stepper_err_t stepper_uninit(stepper_t const * stepper)
 {
+#if NRFX_QDEC_ENABLED
+  if (encoder_owner == stepper->instance_id) {
+    nrfx_qdec_uninit();
+    encoder_owner = -1;
+    k_work_cancel(&states[stepper->instance_id].feedback_work);
+  }
+#endif
+  if (states[stepper->instance_id].shaper.count) {
+    k_timer_stop(&states[stepper->instance_id].shaper_timer);
+    k_work_cancel(&states[stepper->instance_id].shaper_work);
+  }
+  k_timer_stop(&states[stepper->instance_id].idle_timer);
+  k_mutex_lock(&apply_lock, K_FOREVER);
   nrfx_pwm_uninit(PWM_INSTANCE(stepper));
+  states[stepper->instance_id].playing    = false;
+  states[stepper->instance_id].configured = false;
+  states[stepper->instance_id].applied_hz = 0;
+  k_mutex_unlock(&apply_lock);
   return SUCCESS;
 }
 
 stepper_err_t stepper_update_rpm(stepper_t const * stepper, float rpm)
 {
+  state_t * state = &states[stepper->instance_id];
+
+  TRACE_API(TRACE_RPM, stepper->instance_id, stepper_now_us(), (int32_t)(rpm * 1000), 0);
+
+  uint32_t period_us = 0;
+  if (rpm > 0) {
+    period_us = to_period_us(state->config.subdivision, rpm);
+    state->config.rpm = rpm; // resumed by `stepper_start`.
+  }
+
+  if (state->shaper.count) {
+    bool valid = period_valid(&state->config, period_us);
+    state->command_hz      = valid ? 1000000 / period_us : 0;
+    state->command_running = valid;
+    shaper_command(stepper);
+    return valid ? SUCCESS : FREQUENCY_UPDATE_ERROR;
+  }
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  k_mutex_lock(&apply_lock, K_FOREVER);
+  unsigned int key = irq_lock();
+  bool valid = period_valid(&state->config, period_us);
+  stepper_track_set(track, stepper_now_us(), valid ? 1000000 / period_us : 0, track->direction, valid);
+  if (!valid) {
+    stepper_feedbacks[stepper->instance_id].trim_hz = 0;
+  } else if (stepper_feedbacks[stepper->instance_id].trim_hz) {
+    period_us = hz_to_period_us(stepper_feedback_freq(&stepper_feedbacks[stepper->instance_id], track));
+  }
+  state->applied_hz = valid ? stepper_feedback_freq(&stepper_feedbacks[stepper->instance_id], track) : 0;
+  irq_unlock(key);
+
+  stepper_err_t err = apply_period(stepper, period_us);
+  k_mutex_unlock(&apply_lock);
+  return err;
+}
+
+static stepper_err_t apply_period(stepper_t const * stepper, uint32_t period_us)
+{
+  state_t * state = &states[stepper->instance_id];
+
   const nrfx_pwm_t * instance = PWM_INSTANCE(stepper);
 
-  uint32_t period_us = to_period_us(states[stepper->instance_id].config.subdivision, states[stepper->instance_id].config.rpm);
-  uint32_t duty_us   = states[stepper->instance_id].config.pulse_us;
+  if (state->config.dual_edge && period_us < state->config.pulse_us && period_us > 0) {
+    period_us = state->config.pulse_us;  // trimmed by the feedback beyond the limit.
+  }
+  uint32_t duty_us   = state->config.dual_edge ? period_us : state->config.pulse_us;
 
-  if (period_us > 262140 || period_us < 5) { // ~4Hz, 200kHz
+  if (!period_valid(&state->config, period_us)) {
     // stop pwm, since pwm does not support such pulse width (too wide).
     nrfx_pwm_stop(instance, true);
+    state->playing = false;
+    TRACE_RATE(stepper->instance_id, stepper_now_us(), 0, stepper_tracks[stepper->instance_id].direction, false);
+    idle_arm(stepper);
     return FREQUENCY_UPDATE_ERROR;
   }
 
-  nrf_pwm_clk_t pwm_clock = NRF_PWM_CLK_16MHz;
-  // find suitable clock source:
-  if      (period_us > 32767) {  pwm_clock = NRF_PWM_CLK_125kHz;  period_us /= 8;   duty_us /= 8;   }
-  else if (period_us >  1000) {  pwm_clock = NRF_PWM_CLK_1MHz;    period_us *= 1;   duty_us *= 1;   }
-  else                        {  pwm_clock = NRF_PWM_CLK_16MHz;   period_us *= 16;  duty_us *= 16;  }
+  period_us = to_pwm_period_us(&state->config, period_us);
+  nrf_pwm_clk_t pwm_clock = stepper_pwm_clock(&period_us, &duty_us);
+  if (idle_wake(stepper, pwm_clock, (uint16_t) period_us, (uint16_t) duty_us)) {
+    return trace_period(stepper, pwm_clock, period_us, true);  // re-armed, the period starts over.
+  }
+
+  if (state->playing && pwm_clock == stepper_pwm_clocks[stepper->instance_id]) {
+    // same clock: the looped sequence picks up the new top and duty on its next period, as
+    // `stepper_fixed_update_rpm_` does. cheap enough for the feedback interrupt, and the output
+    // keeps its phase instead of restarting at every trim.
+    unsigned int key = irq_lock();
+    nrf_pwm_configure(instance->p_registers, pwm_clock, NRF_PWM_MODE_UP, (uint16_t) period_us);
+    stepper_seq_values[stepper->instance_id] = (nrf_pwm_values_common_t) duty_us;
+    irq_unlock(key);
+    return trace_period(stepper, pwm_clock, period_us, false);
+  }
 
   const nrfx_pwm_config_t pwm_config = {
     .output_pins =
     {
-      states[stepper->instance_id].config.pin_dirs[0] > 0 ? states[stepper->instance_id].config.pin_dirs[0] : NRF_PWM_PIN_NOT_CONNECTED, // channel 0 
-      states[stepper->instance_id].config.pin_dirs[1] > 0 ? states[stepper->instance_id].config.pin_dirs[1] : NRF_PWM_PIN_NOT_CONNECTED, // channel 1
-      states[stepper->instance_id].config.pin_dirs[2] > 0 ? states[stepper->instance_id].config.pin_dirs[2] : NRF_PWM_PIN_NOT_CONNECTED, // channel 2
-      states[stepper->instance_id].config.pin_dirs[3] > 0 ? states[stepper->instance_id].config.pin_dirs[3] : NRF_PWM_PIN_NOT_CONNECTED, // channel 3
+      state->config.pin_pulses[0] > 0 ? state->config.pin_pulses[0] : NRF_PWM_PIN_NOT_CONNECTED, // channel 0 
+      state->config.pin_pulses[1] > 0 ? state->config.pin_pulses[1] : NRF_PWM_PIN_NOT_CONNECTED, // channel 1
+      state->config.pin_pulses[2] > 0 ? state->config.pin_pulses[2] : NRF_PWM_PIN_NOT_CONNECTED, // channel 2
+      state->config.pin_pulses[3] > 0 ? state->config.pin_pulses[3] : NRF_PWM_PIN_NOT_CONNECTED, // channel 3
     },
     .irq_priority = PWM_IRQ_PRIORITY,
     .base_clock   = pwm_clock,            // initial arguments.
@@ -141,7 +539,7 @@ stepper_err_t stepper_update_rpm(stepper_t const * stepper, float rpm)
     .step_mode    = NRF_PWM_STEP_AUTO     // 自动，重复次数后刷新
   };
 
-  // states[stepper->instance_id].pwm_config = pwm_config;
+  // state->pwm_config = pwm_config;
 
   nrfx_err_t err_code = nrfx_pwm_init(instance, &pwm_config, NULL, NULL);
   if (err_code == NRFX_ERROR_ALREADY_INITIALIZED) { // re-init.
@@ -149,16 +547,20 @@ stepper_err_t stepper_update_rpm(stepper_t const * stepper, float rpm)
     err_code = nrfx_pwm_init(instance, &pwm_config, NULL, NULL);
   }
   if (err_code != NRFX_SUCCESS) {
+    state->configured = false;
     return INTERNAL_ERROR;
   }
+  stepper_pwm_clocks[stepper->instance_id] = pwm_clock;
+  state->configured = true;
 
-  nrf_pwm_values_common_t duty_value = (nrf_pwm_values_common_t) duty_us;
+  nrf_pwm_values_common_t * duty_value = &stepper_seq_values[stepper->instance_id];
+  *duty_value = (nrf_pwm_values_common_t) duty_us;
   nrf_pwm_values_t values = {
     .p_common = duty_value,
   };
   nrf_pwm_sequence_t sequence = {
     .values     = values,
-    .length     = NRF_PWM_VALUES_LENGTH(duty_value),
+    .length     = 1,
     .repeats    = 0,
     .end_delay  = 0,
   };
@@ -166,30 +568,127 @@ stepper_err_t stepper_update_rpm(stepper_t const * stepper, float rpm)
   nrfx_pwm_stop(instance, true);
   // uint32_t task_address =
   nrfx_pwm_simple_playback(instance, &sequence, 1, NRFX_PWM_FLAG_LOOP); // loop mode.
+  state->playing = true;
+
+  return trace_period(stepper, pwm_clock, period_us, true);  // re-initialized, the period starts over.
+}
+
+static stepper_err_t trace_period(stepper_t const * stepper, nrf_pwm_clk_t pwm_clock, uint32_t top, bool restart)
+{
+  state_t * state = &states[stepper->instance_id];
+  // the traced period is between two steps, i.e. half of the PWM period in dual-edge mode.
+  uint32_t period_ns = stepper_pwm_period_ns(pwm_clock, top);
+  TRACE_RATE(stepper->instance_id, stepper_now_us(), state->config.dual_edge ? period_ns / 2 : period_ns,
+             stepper_tracks[stepper->instance_id].direction, restart);
+  stepper_idle_woken(&state->idle, stepper_now_us());
 
   return SUCCESS;
 }
 
 stepper_err_t stepper_update_direction(stepper_t const * stepper, bool direction)
 {
-  for (int i = 0; i < 4; i++) {
-    int32_t pin = states[stepper->instance_id].config.pin_dirs[i];
-    if (pin > 0) {
-      if (direction) { nrf_gpio_pin_set(pin); } else { nrf_gpio_pin_clear(pin); }
-    }
+  state_t * state = &states[stepper->instance_id];
+
+  if (state->shaper.count) {
+    TRACE_API(TRACE_DIRECTION, stepper->instance_id, stepper_now_us(), direction, 0);
+    state->command_dir = direction;
+    shaper_command(stepper);  // the pins turn when the shaped velocity does.
+    return SUCCESS;
   }
+
+  write_direction(state, direction);
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  unsigned int key = irq_lock();
+  stepper_track_set(track, stepper_now_us(), track->freq_hz, direction, track->running);
+  irq_unlock(key);
+
+  TRACE_API(TRACE_DIRECTION, stepper->instance_id, stepper_now_us(), direction, 0);
+
   return SUCCESS;
 }
 
 stepper_err_t stepper_start(stepper_t const * stepper)
 {
-  return stepper_update_rpm(stepper, states[stepper->instance_id].config.rpm);
+  state_t * state = &states[stepper->instance_id];
+
+  unsigned int key = irq_lock();
+  if (stepper_feedbacks[stepper->instance_id].stalled) {
+    stepper_feedback_rebase(&stepper_feedbacks[stepper->instance_id], &stepper_tracks[stepper->instance_id], stepper_now_us()); // resume from where the motor really is.
+  }
+  irq_unlock(key);
+  TRACE_API(TRACE_START, stepper->instance_id, stepper_now_us(), 0, 0);
+  return stepper_update_rpm(stepper, state->config.rpm);
 }
 
 stepper_err_t stepper_stop(stepper_t const * stepper)
 {
+  state_t * state = &states[stepper->instance_id];
+  if (state->shaper.count) {
+    TRACE_API(TRACE_STOP, stepper->instance_id, stepper_now_us(), 0, 0);
+    state->command_running = false;
+    shaper_command(stepper);  // the shaped output ramps down after the call.
+    return SUCCESS;
+  }
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  k_mutex_lock(&apply_lock, K_FOREVER);
+  unsigned int key = irq_lock();
+  stepper_track_set(track, stepper_now_us(), track->freq_hz, track->direction, false);
+  stepper_feedbacks[stepper->instance_id].trim_hz = 0;
+  state->applied_hz = 0;
+  irq_unlock(key);
+
   nrfx_pwm_stop(PWM_INSTANCE(stepper), true);
+  state->playing = false;
+  idle_arm(stepper);
+  k_mutex_unlock(&apply_lock);
   // stepper_update_direction(stepper, flase);
+  TRACE_API(TRACE_STOP, stepper->instance_id, stepper_now_us(), 0, 0);
+  TRACE_RATE(stepper->instance_id, stepper_now_us(), 0, track->direction, false);
+  return SUCCESS;
+}
+
+stepper_err_t stepper_get_position(stepper_t const * stepper, int32_t * position)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (!state->inited) {
+    return INVALID_STATE;
+  }
+  unsigned int key = irq_lock();
+  *position = stepper_track_position(&stepper_tracks[stepper->instance_id], stepper_now_us());
+  irq_unlock(key);
+  return SUCCESS;
+}
+
+stepper_err_t stepper_get_following_error(stepper_t const * stepper, int32_t * error)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (!state->inited || stepper_feedbacks[stepper->instance_id].cpr == 0) {
+    return INVALID_STATE;
+  }
+  *error = stepper_feedbacks[stepper->instance_id].error;
+  return SUCCESS;
+}
+
+stepper_err_t stepper_get_idle_stats(stepper_t const * stepper, stepper_idle_stats_t * stats)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (!state->inited) {
+    return INVALID_STATE;
+  }
+  unsigned int key = irq_lock();
+  stepper_idle_stats(&state->idle, stepper_now_us(), stats);
+  irq_unlock(key);
   return SUCCESS;
 }
 
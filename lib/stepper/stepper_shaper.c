@@ -0,0 +1,173 @@
+#include "stepper_shaper.h"
+
+#include <math.h>
+
+#define EI_VIBRATION_TOLERANCE  0.05f   // 5% residual vibration.
+#define PI                      3.14159265f
+#define RING(shaper, i)         (((shaper)->head + (i)) % STEPPER_SHAPER_HISTORY)
+
+stepper_err_t stepper_shaper_init(stepper_shaper_t * shaper, stepper_shaper_type_t type, float freq_hz, float damping)
+{
+  shaper->count = 0;
+  stepper_shaper_reset(shaper, 0);
+  if (type == STEPPER_SHAPER_NONE) {
+    return SUCCESS;
+  }
+  if (!(freq_hz >= 1.0f) || !(damping >= 0.0f && damping < 1.0f)) {
+    return INVALID_PARAMETERS;
+  }
+
+  // half of the damped period, and the decay of the vibration over it.
+  float root    = sqrtf(1.0f - damping * damping);
+  float half_us = 1000000.0f / (2.0f * freq_hz * root);
+  float k       = expf(-damping * PI / root);
+  float v       = EI_VIBRATION_TOLERANCE;
+  float weights[STEPPER_SHAPER_MAX_IMPULSES];
+
+  switch (type) {
+    case STEPPER_SHAPER_ZV:
+      shaper->count = 2;
+      weights[0] = 1.0f;
+      weights[1] = k;
+      break;
+    case STEPPER_SHAPER_ZVD:
+      shaper->count = 3;
+      weights[0] = 1.0f;
+      weights[1] = 2.0f * k;
+      weights[2] = k * k;
+      break;
+    case STEPPER_SHAPER_EI:
+      // exact for no damping, the decay is applied the same way as ZVD otherwise.
+      shaper->count = 3;
+      weights[0] = (1.0f + v) / 4.0f;
+      weights[1] = (1.0f - v) / 2.0f * k;
+      weights[2] = (1.0f + v) / 4.0f * k * k;
+      break;
+    default:
+      return INVALID_PARAMETERS;
+  }
+
+  float total = 0;
+  for (int i = 0; i < shaper->count; i++) total += weights[i];
+
+  // the first amplitude takes the rounding, so that they sum to exactly one.
+  uint32_t rest = 0;
+  for (int i = 1; i < shaper->count; i++) {
+    shaper->amplitudes[i] = (uint16_t) lroundf(weights[i] / total * STEPPER_SHAPER_ONE);
+    shaper->delays_us[i]  = (uint32_t) lroundf(half_us * i);
+    rest += shaper->amplitudes[i];
+  }
+  shaper->amplitudes[0] = (uint16_t)(STEPPER_SHAPER_ONE - rest);
+  shaper->delays_us[0]  = 0;
+  return SUCCESS;
+}
+
+void stepper_shaper_reset(stepper_shaper_t * shaper, int32_t velocity)
+{
+  shaper->base   = velocity;
+  shaper->head   = 0;
+  shaper->length = 0;
+}
+
+/**
+ * make room for one change: two neighbouring changes become one, at the average of their inputs over
+ * the time they lasted, so the integral (the step count) is kept. no impulse may be in the middle of
+ * that time, i.e. `now_us - delays_us[k]` outside of it: those already past it are not affected, and
+ * the others still take all of it. the shortest such span is merged, the shape changes the least.
+*/
+static void merge(stepper_shaper_t * shaper, int64_t now_us) {
+  int     best = -1;
+  int64_t span = 0;
+  for (int j = 0; j + 2 < shaper->length; j++) {
+    int64_t from_us = shaper->stamps_us[RING(shaper, j)];
+    int64_t to_us   = shaper->stamps_us[RING(shaper, j + 2)];
+    bool    split   = false;
+    for (int k = 1; k < shaper->count; k++) {
+      int64_t at_us = now_us - shaper->delays_us[k];
+      if (at_us > from_us && at_us < to_us) split = true;
+    }
+    if (!split && (best < 0 || to_us - from_us < span)) {
+      best = j;
+      span = to_us - from_us;
+    }
+  }
+  // at most 2 spans per impulse are split, out of `STEPPER_SHAPER_HISTORY - 2`.
+  uint8_t first     = RING(shaper, best);
+  uint8_t second    = RING(shaper, best + 1);
+  int64_t middle_us = shaper->stamps_us[second];
+  int64_t sum = (int64_t) shaper->inputs[first] * (middle_us - shaper->stamps_us[first]) +
+                (int64_t) shaper->inputs[second] * (shaper->stamps_us[first] + span - middle_us);
+  // round half away from zero, as the output does. both lasted no time when commanded at once.
+  shaper->inputs[first] = span == 0 ? shaper->inputs[second] :
+                          (int32_t)(sum >= 0 ? (sum + span / 2) / span : (sum - span / 2) / span);
+  for (int j = best + 1; j + 1 < shaper->length; j++) {
+    shaper->inputs[RING(shaper, j)]    = shaper->inputs[RING(shaper, j + 1)];
+    shaper->stamps_us[RING(shaper, j)] = shaper->stamps_us[RING(shaper, j + 1)];
+  }
+  shaper->length--;
+}
+
+void stepper_shaper_input(stepper_shaper_t * shaper, int64_t now_us, int32_t velocity)
+{
+  if (shaper->count == 0) {
+    shaper->base = velocity;
+    return;
+  }
+  // changes older than the longest delay only matter through `base`.
+  int64_t settled_us = now_us - shaper->delays_us[shaper->count - 1];
+  while (shaper->length > 0 && shaper->stamps_us[shaper->head] <= settled_us) {
+    shaper->base = shaper->inputs[shaper->head];
+    shaper->head = RING(shaper, 1);
+    shaper->length--;
+  }
+
+  int32_t last = shaper->length ? shaper->inputs[RING(shaper, shaper->length - 1)] : shaper->base;
+  if (velocity == last) return;
+
+  if (shaper->length == STEPPER_SHAPER_HISTORY) {
+    merge(shaper, now_us);
+  }
+  uint8_t tail = RING(shaper, shaper->length);
+  shaper->inputs[tail]    = velocity;
+  shaper->stamps_us[tail] = now_us;
+  shaper->length++;
+}
+
+int32_t stepper_shaper_output(stepper_shaper_t const * shaper, int64_t now_us)
+{
+  if (shaper->count == 0) return shaper->base;
+
+  int64_t sum = 0;
+  uint8_t i   = 0;
+  int32_t input = shaper->base;
+  // delays are descending from the last impulse, so the scan goes forward through the history once.
+  for (int k = shaper->count - 1; k >= 0; k--) {
+    int64_t at_us = now_us - shaper->delays_us[k];
+    while (i < shaper->length && shaper->stamps_us[RING(shaper, i)] <= at_us) {
+      input = shaper->inputs[RING(shaper, i)];
+      i++;
+    }
+    sum += (int64_t) shaper->amplitudes[k] * input;
+  }
+  // round half away from zero, keeps both directions symmetric.
+  return (int32_t)(sum >= 0 ? (sum + STEPPER_SHAPER_ONE / 2) / STEPPER_SHAPER_ONE
+                            : (sum - STEPPER_SHAPER_ONE / 2) / STEPPER_SHAPER_ONE);
+}
+
+bool stepper_shaper_next(stepper_shaper_t const * shaper, int64_t now_us, int64_t * next_us)
+{
+  bool    pending = false;
+  int64_t next    = 0;
+  for (uint8_t i = 0; i < shaper->length; i++) {
+    int64_t stamp_us = shaper->stamps_us[RING(shaper, i)];
+    for (int k = 1; k < shaper->count; k++) {
+      int64_t at_us = stamp_us + shaper->delays_us[k];
+      if (at_us > now_us && (!pending || at_us < next)) {
+        next    = at_us;
+        pending = true;
+      }
+    }
+  }
+  if (pending) *next_us = next;
+  return pending;
+}
@@ -0,0 +1,73 @@
+#ifndef STEPPER_SHAPER_H__
+#define STEPPER_SHAPER_H__
+
+#include "stepper.h"
+
+/************************************* input shaping **************************************/
+
+// for internal use only, shared by all mcu backends, no hardware access in here.
+
+/**
+ * the step peripherals emit a constant rate between two updates, so the commanded trajectory is a
+ * sequence of rate (signed velocity) changes. the shaper convolves it with the impulse sequence:
+ *
+ *   output(t) = sum(amplitudes[k] * input(t - delays_us[k]))
+ *
+ * every input change comes out as `count` smaller changes, the last one `delays_us[count - 1]` later.
+ * amplitudes sum to exactly 1, so the output settles on the input and the total number of steps is
+ * kept (within the rounding of the transient rates, below 1 step per change). changes beyond the
+ * history are merged with their neighbour, see `stepper_shaper_input`, the step count is kept too.
+ *
+ * integer only after init, every call is bounded by `STEPPER_SHAPER_HISTORY * STEPPER_SHAPER_MAX_IMPULSES`.
+*/
+
+#define STEPPER_SHAPER_MAX_IMPULSES   3
+#define STEPPER_SHAPER_HISTORY        16    // input changes kept within the longest delay.
+#define STEPPER_SHAPER_ONE            (1 << 15)
+
+typedef struct {
+  uint8_t   count;                                    // number of impulses, 0 means disabled.
+  uint16_t  amplitudes[STEPPER_SHAPER_MAX_IMPULSES];  // Q15, sum is exactly `STEPPER_SHAPER_ONE`.
+  uint32_t  delays_us[STEPPER_SHAPER_MAX_IMPULSES];   // ascending, the first one is 0.
+  int32_t   base;                                     // input before the oldest change kept.
+  int32_t   inputs[STEPPER_SHAPER_HISTORY];           // ring of input changes, signed steps/s.
+  int64_t   stamps_us[STEPPER_SHAPER_HISTORY];
+  uint8_t   head;                                     // oldest change.
+  uint8_t   length;
+} stepper_shaper_t;
+
+/**
+ * @brief compute the impulse sequence, `STEPPER_SHAPER_NONE` disables the shaper.
+ *
+ * @return
+ *    - SUCCESS             valid parameters.
+ *    - INVALID_PARAMETERS  unknown type, `freq_hz` below 1Hz, or `damping` out of [0, 1).
+*/
+stepper_err_t stepper_shaper_init(stepper_shaper_t * shaper, stepper_shaper_type_t type, float freq_hz, float damping);
+
+/**
+ * @brief forget the history, the output jumps to `velocity` at once, i.e. on a stall.
+*/
+void stepper_shaper_reset(stepper_shaper_t * shaper, int32_t velocity);
+
+/**
+ * @brief the commanded velocity changes to `velocity` at `now_us`, which must not go backwards.
+ *        when more than `STEPPER_SHAPER_HISTORY` changes are still in flight, two neighbouring ones
+ *        are merged into their average input over the time they lasted: the ramp is coarser, but the
+ *        output at `now_us` and the total number of steps are kept.
+*/
+void stepper_shaper_input(stepper_shaper_t * shaper, int64_t now_us, int32_t velocity);
+
+/**
+ * @brief shaped velocity at `now_us`, signed steps/s.
+*/
+int32_t stepper_shaper_output(stepper_shaper_t const * shaper, int64_t now_us);
+
+/**
+ * @brief next time after `now_us` the output changes, the backend re-applies the output then.
+ *
+ * @return `false` when the output is settled.
+*/
+bool stepper_shaper_next(stepper_shaper_t const * shaper, int64_t now_us, int64_t * next_us);
+
+#endif // STEPPER_SHAPER_H__
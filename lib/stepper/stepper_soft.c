@@ -1,8 +1,279 @@
 #include "stepper.h"
 
-#if !defined(MCU_ESP32) & !defined(MCU_NORDIC_RF) & !defined(MCU_STM32) & !defined(MCU_STM8)
+#if defined(MCU_SOFT)
 
-stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * config);
+#include "stepper_feedback.h"
+#include "stepper_idle.h"
+#include "stepper_shaper.h"
+#include "stepper_soft.h"
+#include "stepper_trace.h"
+
+// host simulation, no pin is driven: the step output is the ideal rate of the ESP32 formula,
+// visible through position accounting, the mocked motor and the trace.
+#define MAX_SUPPORT_STEPPER_NUMBER  16
+
+typedef struct {
+  stepper_config_t  config;
+  bool              running;
+  bool              inited;
+  // input shaping: the API commands go into the shaper, its output drives the track.
+  stepper_shaper_t  shaper;
+  uint32_t          command_hz;
+  bool              command_dir;
+  // low-power idle: the hold timer and the wake-up of the step peripheral are played by `stepper_soft_set_time`.
+  stepper_idle_t    idle;
+  int64_t           idle_at_us;
+  bool              idle_armed;
+  int64_t           encoder;      // counts at the previous feedback sample.
+} state_t;
+
+static state_t          states[MAX_SUPPORT_STEPPER_NUMBER];
+static stepper_t        instances[MAX_SUPPORT_STEPPER_NUMBER];
+static int64_t          clock_us = 0;
+static int64_t          feedback_at_us = -1;  // next feedback sample, -1 without encoder.
+
+// position accounting and closed-loop feedback, same layout as the mcu backends.
+stepper_track_t         stepper_tracks[MAX_SUPPORT_STEPPER_NUMBER];
+stepper_feedback_t      stepper_feedbacks[MAX_SUPPORT_STEPPER_NUMBER];
+stepper_soft_periph_t   stepper_soft_periphs[MAX_SUPPORT_STEPPER_NUMBER];
+
+static inline uint32_t to_freq_hz(uint32_t subdivision, uint32_t rpm) {
+  return rpm * subdivision / 60;
+}
+
+int64_t stepper_now_us(void)
+{
+  return clock_us;
+}
+
+bool stepper_soft_periph_update(uint8_t idx)
+{
+  stepper_soft_periph_t * periph = &stepper_soft_periphs[idx];
+  uint32_t top = periph->regs.top;
+  if (periph->ready_us > clock_us) return false;
+  stepper_track_set(&periph->output, clock_us, top ? STEPPER_SOFT_CLOCK_HZ / top : 0, periph->regs.dir, top > 0);
+  return true;
+}
+
+// program the step output, the mocked motor follows it from now on.
+static void write_output(uint8_t id, uint32_t freq, bool direction) {
+  stepper_soft_regs_t * regs = &stepper_soft_periphs[id].regs;
+  regs->top  = freq ? STEPPER_SOFT_CLOCK_HZ / freq : 0;
+  regs->duty = states[id].config.pulse_us * (STEPPER_SOFT_CLOCK_HZ / 1000000);
+  regs->dir  = direction;
+  if (stepper_soft_periph_update(id)) {
+    TRACE_RATE(id, clock_us, stepper_soft_period_ns(regs->top), direction, false);  // the output keeps its phase.
+  }
+}
+
+// step rate with the feedback trim applied, 0 when stopped.
+static uint32_t output_freq(uint8_t id) {
+  stepper_track_t const * track = &stepper_tracks[id];
+  return track->running ? stepper_feedback_freq(&stepper_feedbacks[id], track) : 0;
+}
+
+static int64_t encoder_count(uint8_t id) {
+  stepper_soft_periph_t const * periph = &stepper_soft_periphs[id];
+  int64_t steps = stepper_track_position(&periph->output, clock_us) - periph->skipped;
+  return steps * stepper_feedbacks[id].cpr / states[id].config.subdivision;
+}
+
+static void idle_arm(uint8_t id) {
+  if (states[id].idle.hold_us == 0) return;
+  states[id].idle_armed = true;
+  states[id].idle_at_us = clock_us + states[id].idle.hold_us;
+}
+
+// the output follows the registers again once the peripheral is ready, see `periph_ready`.
+static void idle_wake(uint8_t id) {
+  stepper_soft_periph_t * periph = &stepper_soft_periphs[id];
+  states[id].idle_armed = false;
+  if (!stepper_idle_wake(&states[id].idle, clock_us)) return;
+  if (periph->wake_latency_us) {
+    periph->ready_us = clock_us + periph->wake_latency_us;
+  } else {
+    stepper_idle_woken(&states[id].idle, clock_us);
+  }
+}
+
+// wake-up latency elapsed: the output takes the registers written meanwhile, from a full period.
+static void periph_ready(uint8_t id) {
+  stepper_soft_periph_t * periph = &stepper_soft_periphs[id];
+  periph->ready_us = 0;
+  stepper_soft_periph_update(id);
+  TRACE_RATE(id, clock_us, stepper_soft_period_ns(periph->regs.top), periph->regs.dir, true);
+  stepper_idle_woken(&states[id].idle, clock_us);
+}
+
+// emit the shaped velocity from now on.
+static void shaper_apply(uint8_t id) {
+  stepper_track_t * track = &stepper_tracks[id];
+  int32_t  velocity  = stepper_shaper_output(&states[id].shaper, clock_us);
+  uint32_t freq      = velocity < 0 ? -velocity : velocity;
+  bool     direction = velocity ? velocity > 0 : track->direction;
+  if (freq == track->freq_hz && direction == track->direction && track->running == (freq > 0)) return;
+
+  if (freq) {
+    idle_wake(id);
+  } else {
+    stepper_feedbacks[id].trim_hz = 0;
+    idle_arm(id);
+  }
+  stepper_track_set(track, clock_us, freq, direction, freq > 0);
+  write_output(id, output_freq(id), direction);
+}
+
+static void shaper_command(uint8_t id) {
+  state_t * state = &states[id];
+  int32_t velocity = state->running ? (int32_t) state->command_hz : 0;
+  stepper_shaper_input(&state->shaper, clock_us, state->command_dir ? velocity : -velocity);
+  shaper_apply(id);
+}
+
+// fixed rate sampling of the following error, as the ESP32 feedback timer does.
+static void feedback_sample(void) {
+  for (int i = 0; i < MAX_SUPPORT_STEPPER_NUMBER; i++) {
+    if (!states[i].inited || stepper_feedbacks[i].cpr == 0) continue;
+    int64_t count = encoder_count(i);
+    int32_t delta = (int32_t)(count - states[i].encoder);
+    states[i].encoder = count;
+
+    stepper_feedback_action_t action = stepper_feedback_sample(&stepper_feedbacks[i], &stepper_tracks[i], clock_us, delta);
+    int32_t error = stepper_feedbacks[i].error;
+    int32_t trim  = stepper_feedbacks[i].trim_hz;
+
+    stepper_event_handler_t handler = states[i].config.event_handler;
+    if (action == FEEDBACK_TRIM && stepper_tracks[i].running) {
+      write_output(i, output_freq(i), stepper_tracks[i].direction);
+      TRACE_FEEDBACK(i, clock_us, trim ? STEPPER_EVENT_CORRECTION : STEPPER_EVENT_RECOVERED, error);
+      if (handler) handler(&instances[i], trim ? STEPPER_EVENT_CORRECTION : STEPPER_EVENT_RECOVERED, error);
+    } else if (action == FEEDBACK_STALL) {
+      stepper_shaper_reset(&states[i].shaper, 0);  // halt at once, without the shaped ramp down.
+      stepper_stop(&instances[i]);
+      TRACE_FEEDBACK(i, clock_us, STEPPER_EVENT_STALL, error);
+      if (handler) handler(&instances[i], STEPPER_EVENT_STALL, error);
+    }
+  }
+}
+
+typedef enum {
+  EVENT_NONE = 0,
+  EVENT_SHAPER,
+  EVENT_IDLE,
+  EVENT_WAKE,
+  EVENT_FEEDBACK,
+} event_t;
+
+void stepper_soft_set_time(int64_t now_us)
+{
+  // play the shaper updates, idle entries, wake-ups and feedback samples due in between, each at its own time.
+  for (;;) {
+    int     id      = -1;
+    event_t event   = EVENT_NONE;
+    int64_t next_us = now_us;
+    for (int i = 0; i < MAX_SUPPORT_STEPPER_NUMBER; i++) {
+      int64_t at_us = 0;
+      if (!states[i].inited) continue;
+      if (stepper_shaper_next(&states[i].shaper, clock_us, &at_us) && at_us <= next_us) {
+        id      = i;
+        event   = EVENT_SHAPER;
+        next_us = at_us;
+      }
+      if (states[i].idle_armed && states[i].idle_at_us <= next_us) {
+        id      = i;
+        event   = EVENT_IDLE;
+        next_us = states[i].idle_at_us;
+      }
+      if (stepper_soft_periphs[i].ready_us && stepper_soft_periphs[i].ready_us <= next_us) {
+        id      = i;
+        event   = EVENT_WAKE;
+        next_us = stepper_soft_periphs[i].ready_us;
+      }
+    }
+    if (feedback_at_us > -1 && feedback_at_us <= next_us) {
+      event   = EVENT_FEEDBACK;
+      next_us = feedback_at_us;
+    }
+    if (event == EVENT_NONE) break;
+    clock_us = next_us;
+    if (event == EVENT_FEEDBACK) {
+      feedback_at_us += STEPPER_SOFT_FEEDBACK_PERIOD_US;
+      feedback_sample();
+    } else if (event == EVENT_IDLE) {
+      states[id].idle_armed = false;
+      stepper_idle_enter(&states[id].idle, clock_us);
+    } else if (event == EVENT_WAKE) {
+      periph_ready(id);
+    } else {
+      shaper_apply(id);
+    }
+  }
+  if (now_us > clock_us) clock_us = now_us;
+}
+
+void stepper_soft_skip_steps(stepper_t const * stepper, int32_t steps)
+{
+  stepper_soft_periphs[stepper->instance_id].skipped += steps;
+}
+
+void stepper_soft_set_wake_latency(stepper_t const * stepper, uint32_t latency_us)
+{
+  stepper_soft_periphs[stepper->instance_id].wake_latency_us = latency_us;
+}
+
+/**
+ * @brief initialize stepper device and config it.
+ * 
+ * @param stepper the instance of device
+ * @param config  configuration
+ * 
+ * @return `stepper_err_t`
+ *    - SUCCESS             initialize successfully.
+ *    - INVALID_PARAMETERS  make sure your instance id is valid, GPIO pin is avaliable, and shaper parameters are valid.
+ *    - INVALID_STATE       this instance was already initialized, or it is running.
+ *    - INTERNAL_ERROR      mcu internal error.
+*/
+stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * config)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  state_t * state = &states[stepper->instance_id];
+  if (state->inited) {
+    return INVALID_STATE;  // Stepper is already inited.
+  }
+  if (stepper_shaper_init(&state->shaper, config->shaper, config->shaper_freq_hz, config->shaper_damping) != SUCCESS) {
+    return INVALID_PARAMETERS;
+  }
+  if (stepper_idle_init(&state->idle, config) != SUCCESS) {
+    return INVALID_PARAMETERS;
+  }
+  state->config         = *config;
+  state->config.rpm     = config->rpm > 0 ? config->rpm : 1;
+  state->running        = false;
+  state->idle_armed     = false;
+
+  uint32_t freq = to_freq_hz(state->config.subdivision, state->config.rpm);
+  state->command_hz     = freq;
+  state->command_dir    = config->direction;
+  instances[stepper->instance_id] = *stepper;
+  stepper_tracks[stepper->instance_id] = (stepper_track_t) { 0 };  // counts from 0, as the encoder does.
+  stepper_track_set(&stepper_tracks[stepper->instance_id], clock_us, freq, config->direction, false);
+  uint32_t wake_latency_us = stepper_soft_periphs[stepper->instance_id].wake_latency_us;
+  stepper_soft_periphs[stepper->instance_id] = (stepper_soft_periph_t) { .wake_latency_us = wake_latency_us };
+  stepper_soft_periphs[stepper->instance_id].regs.dir = config->direction;
+  stepper_soft_periph_update(stepper->instance_id);
+  stepper_feedback_init(&stepper_feedbacks[stepper->instance_id], config, STEPPER_SOFT_FEEDBACK_PERIOD_US);
+  state->encoder        = 0;
+  if (stepper_feedbacks[stepper->instance_id].cpr && feedback_at_us < 0) {
+    feedback_at_us = clock_us + STEPPER_SOFT_FEEDBACK_PERIOD_US;
+  }
+  TRACE_CONFIG(stepper->instance_id, clock_us, config);
+  TRACE_API(TRACE_DIRECTION, stepper->instance_id, clock_us, config->direction, 0);
+
+  state->inited = true;
+  return SUCCESS;
+}
 
 /**
  * @brief uninitalize stepper device.
@@ -15,6 +286,8 @@ stepper_err_t stepper_init(stepper_t const * stepper, stepper_config_t const * c
 */
 stepper_err_t stepper_uninit(stepper_t const * stepper)
 {
+  stepper_stop(stepper);
+  states[stepper->instance_id].inited = false;
   return SUCCESS;
 }
 
@@ -27,11 +300,36 @@ stepper_err_t stepper_uninit(stepper_t const * stepper)
  * @return
  *    - SUCCESS                 update successfully.
  *    - FREQUENCY_UPDATE_ERROR  frequency error, you can check your speed if it is a valid number and in a valid range.
+ *                              with `config.dual_edge`, one step must not be shorter than `config.pulse_us`.
  *    - DUTY_UPDATE_ERROR       duty error, please check `config.subdivision`, the value of `config.subdivision` usually valid from 3 to 10 micromills.
  *    - INTERNAL_ERROR          mcu internal error.
 */
-stepper_err_t stepper_update_rpm(stepper_t const * stepper, uint32_t rpm)
+stepper_err_t stepper_update_rpm(stepper_t const * stepper, float rpm)
 {
+  TRACE_API(TRACE_RPM, stepper->instance_id, clock_us, (int32_t)(rpm * 1000), 0);
+
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  stepper_config_t const * config = &states[stepper->instance_id].config;
+  uint32_t freq = to_freq_hz(config->subdivision, rpm);
+  if (config->dual_edge) {
+    freq &= ~1u;  // the output runs at half of the step rate, as on ESP32.
+    if ((uint64_t) freq * config->pulse_us > 1000000) {
+      return FREQUENCY_UPDATE_ERROR;
+    }
+  }
+  if (freq < 10) {
+    return stepper_stop(stepper);
+  }
+
+  states[stepper->instance_id].running = true;
+  if (states[stepper->instance_id].shaper.count) {
+    states[stepper->instance_id].command_hz = freq;
+    shaper_command(stepper->instance_id);
+    return SUCCESS;
+  }
+  idle_wake(stepper->instance_id);
+  stepper_track_set(track, clock_us, freq, track->direction, true);
+  write_output(stepper->instance_id, output_freq(stepper->instance_id), track->direction);
   return SUCCESS;
 }
 
@@ -50,6 +348,16 @@ stepper_err_t stepper_update_rpm(stepper_t const * stepper, uint32_t rpm)
 */
 stepper_err_t stepper_update_direction(stepper_t const * stepper, bool direction)
 {
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  TRACE_API(TRACE_DIRECTION, stepper->instance_id, clock_us, direction, 0);
+  if (states[stepper->instance_id].shaper.count) {
+    states[stepper->instance_id].command_dir = direction;
+    shaper_command(stepper->instance_id);
+    return SUCCESS;
+  }
+  stepper_track_set(track, clock_us, track->freq_hz, direction, track->running);
+  stepper_soft_periphs[stepper->instance_id].regs.dir = direction;
+  stepper_soft_periph_update(stepper->instance_id);
   return SUCCESS;
 }
 
@@ -64,11 +372,27 @@ stepper_err_t stepper_update_direction(stepper_t const * stepper, bool direction
 */
 stepper_err_t stepper_start(stepper_t const * stepper)
 {
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  if (stepper_feedbacks[stepper->instance_id].stalled) {
+    stepper_feedback_rebase(&stepper_feedbacks[stepper->instance_id], track, clock_us); // resume from where the motor really is.
+  }
+  states[stepper->instance_id].running = true;
+  TRACE_API(TRACE_START, stepper->instance_id, clock_us, 0, 0);
+  if (states[stepper->instance_id].shaper.count) {
+    shaper_command(stepper->instance_id);
+    return SUCCESS;
+  }
+  idle_wake(stepper->instance_id);
+  stepper_track_set(track, clock_us, track->freq_hz, track->direction, true);
+  if (track->freq_hz) {
+    write_output(stepper->instance_id, output_freq(stepper->instance_id), track->direction);
+  }
   return SUCCESS;
 }
 
 /**
- * @brief stop (pause) motor rotation.
+ * @brief stop (pause) motor rotation. with `config.idle_hold_ms`, the driver keeps holding for that long,
+ *        then the step peripheral is released and the driver de-energized, until the next start.
  * 
  * @param stepper   the instance of device
  * 
@@ -78,6 +402,88 @@ stepper_err_t stepper_start(stepper_t const * stepper)
 */
 stepper_err_t stepper_stop(stepper_t const * stepper)
 {
+  stepper_track_t * track = &stepper_tracks[stepper->instance_id];
+  states[stepper->instance_id].running = false;
+  TRACE_API(TRACE_STOP, stepper->instance_id, clock_us, 0, 0);
+  if (states[stepper->instance_id].shaper.count) {
+    shaper_command(stepper->instance_id);  // the shaped output ramps down after the call.
+    return SUCCESS;
+  }
+  stepper_track_set(track, clock_us, track->freq_hz, track->direction, false);
+  stepper_feedbacks[stepper->instance_id].trim_hz = 0;
+  if (stepper_soft_periphs[stepper->instance_id].regs.top) {  // also while waking up, not running yet.
+    write_output(stepper->instance_id, 0, track->direction);
+  }
+  idle_arm(stepper->instance_id);
+  return SUCCESS;
+}
+
+/**
+ * @brief read the commanded position, i.e. the number of steps emitted since initialized.
+ * 
+ * @param stepper   the instance of device
+ * @param position  output, in steps, positive direction counts up.
+ * 
+ * @return
+ *    - SUCCESS             read successfully.
+ *    - INVALID_PARAMETERS  invalid instance id.
+ *    - INVALID_STATE       this instance is not initialized.
+*/
+stepper_err_t stepper_get_position(stepper_t const * stepper, int32_t * position)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  if (!states[stepper->instance_id].inited) {
+    return INVALID_STATE;
+  }
+  *position = stepper_track_position(&stepper_tracks[stepper->instance_id], clock_us);
+  return SUCCESS;
+}
+
+/**
+ * @brief read the latest following error sampled by the closed-loop feedback.
+ * 
+ * @param stepper   the instance of device
+ * @param error     output, commanded position minus encoder position, in steps.
+ * 
+ * @return
+ *    - SUCCESS             read successfully.
+ *    - INVALID_PARAMETERS  invalid instance id.
+ *    - INVALID_STATE       this instance is not initialized, or it runs without encoder.
+*/
+stepper_err_t stepper_get_following_error(stepper_t const * stepper, int32_t * error)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  if (!states[stepper->instance_id].inited || stepper_feedbacks[stepper->instance_id].cpr == 0) {
+    return INVALID_STATE;
+  }
+  *error = stepper_feedbacks[stepper->instance_id].error;
+  return SUCCESS;
+}
+
+/**
+ * @brief read the low-power idle statistics, see `config.idle_hold_ms`.
+ * 
+ * @param stepper   the instance of device
+ * @param stats     output, time spent idle and measured wake-up latency.
+ * 
+ * @return
+ *    - SUCCESS             read successfully.
+ *    - INVALID_PARAMETERS  invalid instance id.
+ *    - INVALID_STATE       this instance is not initialized.
+*/
+stepper_err_t stepper_get_idle_stats(stepper_t const * stepper, stepper_idle_stats_t * stats)
+{
+  if (stepper->instance_id >= MAX_SUPPORT_STEPPER_NUMBER) {
+    return INVALID_PARAMETERS;
+  }
+  if (!states[stepper->instance_id].inited) {
+    return INVALID_STATE;
+  }
+  stepper_idle_stats(&states[stepper->instance_id].idle, clock_us, stats);
   return SUCCESS;
 }
 
@@ -0,0 +1,81 @@
+#ifndef STEPPER_SOFT_H__
+#define STEPPER_SOFT_H__
+
+#include "stepper_feedback.h"
+
+#if defined(MCU_SOFT)
+
+/************************************* soft backend ***************************************/
+
+// host simulation, for tests and tools: a simulated clock, and a mocked motor with its encoder.
+
+/**
+ * every instance has a mocked step peripheral: the driver writes its registers, then triggers
+ * `stepper_soft_periph_update`, from where the output emits at the programmed rate, as the LEDC /
+ * PWM do after a timer update. the generic and the fixed (`stepper_fixed.h`) paths both drive it.
+ * after a low-power idle, the output takes the registers only `stepper_soft_set_wake_latency` later,
+ * the clock and register restore of the real peripheral, and the idle statistics measure that.
+ *
+ * the mocked motor follows the step output, except for the steps it skipped. its encoder has
+ * `config.encoder_cpr` counts per round, and is sampled every `STEPPER_SOFT_FEEDBACK_PERIOD_US`
+ * of simulated time, as the ESP32 feedback timer does.
+*/
+
+#define STEPPER_SOFT_CLOCK_HZ             16000000  // step timer clock, as the 16MHz PWM clock of nRF52.
+#define STEPPER_SOFT_FEEDBACK_PERIOD_US   1000
+
+typedef struct {
+  volatile uint32_t top;          // timer ticks per step, 0 halts the output.
+  volatile uint32_t duty;         // timer ticks of the STEP pulse.
+  volatile uint32_t dir;          // level of the DIR pin.
+} stepper_soft_regs_t;
+
+typedef struct {
+  stepper_soft_regs_t regs;
+  stepper_track_t     output;     // steps emitted by the step output.
+  int32_t             skipped;    // steps the motor did not follow, positive direction counts up.
+  uint32_t            wake_latency_us;
+  int64_t             ready_us;   // waking up: the output takes the registers at that time, 0 otherwise.
+} stepper_soft_periph_t;
+
+extern stepper_soft_periph_t  stepper_soft_periphs[];
+extern stepper_track_t        stepper_tracks[];
+extern stepper_feedback_t     stepper_feedbacks[];
+
+/**
+ * @brief set the simulated clock used by the following calls, i.e. to replay a trace. the shaper
+ *        updates, idle entries and feedback samples due in between are played at their own time.
+ *
+ * @param now_us  microseconds, never goes backwards.
+*/
+void stepper_soft_set_time(int64_t now_us);
+
+/**
+ * @brief the output takes the registers of instance `idx` from now on, i.e. the timer update.
+ *
+ * @return `false` while waking up, the output takes them once ready.
+*/
+bool stepper_soft_periph_update(uint8_t idx);
+
+// real step period of `top` ticks, in ns.
+static inline uint32_t stepper_soft_period_ns(uint32_t top) {
+  return (uint32_t)((uint64_t) top * 1000000000 / STEPPER_SOFT_CLOCK_HZ);
+}
+
+/**
+ * @brief the motor misses `steps` of the emitted steps from now on, as under an overload, so the
+ *        encoder falls behind the commanded position.
+ *
+ * @param steps   positive direction counts up, i.e. negative while running backwards.
+*/
+void stepper_soft_skip_steps(stepper_t const * stepper, int32_t steps);
+
+/**
+ * @brief the step peripheral runs again `latency_us` after each wake-up from idle, 0 by default.
+ *        kept by `stepper_init`, as a property of the hardware.
+*/
+void stepper_soft_set_wake_latency(stepper_t const * stepper, uint32_t latency_us);
+
+#endif
+
+#endif // STEPPER_SOFT_H__
@@ -0,0 +1,377 @@
+#include "stepper_trace.h"
+#include "stepper_feedback.h"
+
+#include <string.h>
+
+#if defined(MCU_ESP32)
+#include <freertos/FreeRTOS.h>
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+#define TRACE_LOCK()      portENTER_CRITICAL_SAFE(&trace_lock)
+#define TRACE_UNLOCK()    portEXIT_CRITICAL_SAFE(&trace_lock)
+#elif defined(MCU_NORDIC_RF)
+#include <zephyr.h>
+#define TRACE_LOCK()      unsigned int key_ = irq_lock()
+#define TRACE_UNLOCK()    irq_unlock(key_)
+#else
+#define TRACE_LOCK()
+#define TRACE_UNLOCK()
+#endif
+
+#define RECORD_MAX_LEN    32  // 1 + 10 + 20 (TRACE_INIT), rounded up.
+
+static struct {
+  uint8_t *             start;    // whole RAM buffer.
+  uint8_t *             buffer;   // recording half with a sink, else `start`.
+  uint32_t              size;     // of `buffer`.
+  uint32_t              used;     // bytes in `buffer`.
+  uint64_t              total;    // bytes recorded, flushed included, streamed traces pass 4GiB.
+  uint32_t              dropped;
+  stepper_trace_sink_t  sink;
+  void *                context;
+  int64_t               last_us;
+  volatile bool         recording;
+  volatile bool         flushing; // the other half is with the sink.
+} recorder;
+
+static inline uint32_t put_varint(uint8_t * out, uint64_t value) {
+  uint32_t len = 0;
+  while (value >= 0x80) {
+    out[len++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[len++] = (uint8_t) value;
+  return len;
+}
+
+// float32 as its bits, little-endian, so the replay gets the very same value.
+static inline uint32_t put_float(uint8_t * out, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, 4);
+  for (int i = 0; i < 4; i++) out[i] = (uint8_t)(bits >> (8 * i));
+  return 4;
+}
+
+static inline uint64_t zigzag(int64_t value) {
+  return ((uint64_t) value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t value) {
+  return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+static void trace_flush(uint8_t const * data, uint32_t length) {
+  recorder.sink(recorder.context, data, length);
+  TRACE_LOCK();
+  recorder.flushing = false;
+  TRACE_UNLOCK();
+}
+
+// append one record, `payload` is already encoded.
+static void trace_write(uint8_t type, uint8_t instance_id, int64_t now_us, uint8_t const * payload, uint32_t payload_len) {
+  uint8_t   record[RECORD_MAX_LEN];
+  uint8_t * flush     = NULL;
+  uint32_t  flush_len = 0;
+
+  TRACE_LOCK();
+  if (recorder.recording) {
+    int64_t delta = now_us - recorder.last_us;  // since the previous stored record, a dropped one does not count.
+    if (delta < 0) delta = 0;  // clocks of different contexts, keep the stream monotonic.
+
+    uint32_t len = 0;
+    record[len++] = (uint8_t)(type | (instance_id << 4));
+    len += put_varint(&record[len], (uint64_t) delta);
+    memcpy(&record[len], payload, payload_len);
+    len += payload_len;
+
+    if (recorder.used + len > recorder.size && recorder.sink && !recorder.flushing) {
+      // swap the halves, the full one goes to the sink after the lock is released.
+      flush     = recorder.buffer;
+      flush_len = recorder.used;
+      recorder.buffer   = recorder.buffer == recorder.start ? recorder.start + recorder.size : recorder.start;
+      recorder.used     = 0;
+      recorder.flushing = true;
+    }
+    if (recorder.used + len > recorder.size) {
+      recorder.dropped++;
+    } else {
+      memcpy(&recorder.buffer[recorder.used], record, len);
+      recorder.used    += len;
+      recorder.total   += len;
+      recorder.last_us += delta;
+    }
+  }
+  TRACE_UNLOCK();
+
+  if (flush) trace_flush(flush, flush_len);
+}
+
+void stepper_trace_init(uint8_t instance_id, int64_t now_us, stepper_config_t const * config)
+{
+  if (!recorder.recording) return;
+
+  uint8_t payload[20];
+  uint32_t len = put_varint(payload, config->subdivision);
+  len += put_varint(&payload[len], config->pulse_us);
+  payload[len++] = config->dual_edge ? STEPPER_TRACE_DUAL_EDGE : 0;  // the rate is rounded to even steps.
+  payload[len++] = (uint8_t) config->shaper;
+  len += put_float(&payload[len], config->shaper_freq_hz);
+  len += put_float(&payload[len], config->shaper_damping);
+  trace_write(TRACE_INIT, instance_id, now_us, payload, len);
+}
+
+void stepper_trace_api(uint8_t type, uint8_t instance_id, int64_t now_us, int32_t value, uint32_t extra)
+{
+  if (!recorder.recording) return;
+
+  uint8_t payload[12];
+  uint32_t len = 0;
+  switch (type) {
+    case TRACE_RPM:         len = put_varint(payload, zigzag(value));     break;
+    case TRACE_DIRECTION:   payload[len++] = value ? 1 : 0;               break;
+    default:                break;
+  }
+  trace_write(type, instance_id, now_us, payload, len);
+}
+
+void stepper_trace_rate(uint8_t instance_id, int64_t now_us, uint32_t period_ns, bool direction, bool restart)
+{
+  if (!recorder.recording) return;
+
+  uint8_t payload[8];
+  uint32_t len = put_varint(payload, period_ns);
+  payload[len++] = (direction ? 1 : 0) | (restart ? STEPPER_TRACE_RESTART : 0);
+  trace_write(TRACE_RATE, instance_id, now_us, payload, len);
+}
+
+void stepper_trace_event(uint8_t instance_id, int64_t now_us, uint8_t event, int32_t error)
+{
+  if (!recorder.recording) return;
+
+  uint8_t payload[8];
+  payload[0] = event;
+  uint32_t len = 1 + put_varint(&payload[1], zigzag(error));
+  trace_write(TRACE_EVENT, instance_id, now_us, payload, len);
+}
+
+stepper_err_t stepper_trace_start(uint8_t * buffer, uint32_t size, stepper_trace_sink_t sink, void * context)
+{
+#if !defined(STEPPER_TRACE)
+  return INVALID_STATE;
+#else
+  if (buffer == NULL || size < 64) {
+    return INVALID_PARAMETERS;
+  }
+  if (recorder.recording) {
+    return INVALID_STATE;
+  }
+  recorder.start    = buffer;
+  recorder.buffer   = buffer;
+  recorder.size     = sink ? size / 2 : size;
+  recorder.flushing = false;
+  recorder.sink     = sink;
+  recorder.context  = context;
+  recorder.dropped  = 0;
+  recorder.last_us  = stepper_now_us();
+
+  memcpy(buffer, STEPPER_TRACE_MAGIC, 4);
+  buffer[4] = STEPPER_TRACE_VERSION;
+  buffer[5] = buffer[6] = buffer[7] = 0;
+  recorder.used     = STEPPER_TRACE_HEADER_LEN;
+  recorder.total    = STEPPER_TRACE_HEADER_LEN;
+
+  recorder.recording = true;
+  return SUCCESS;
+#endif
+}
+
+stepper_err_t stepper_trace_stop(uint64_t * length, uint32_t * dropped)
+{
+  if (!recorder.recording) {
+    return INVALID_STATE;
+  }
+  trace_write(TRACE_END, 0, stepper_now_us(), NULL, 0);
+
+  uint8_t * flush     = NULL;
+  uint32_t  flush_len = 0;
+  TRACE_LOCK();
+  recorder.recording = false;
+  if (recorder.sink && recorder.used) {
+    flush     = recorder.buffer;
+    flush_len = recorder.used;
+    recorder.used     = 0;
+    recorder.flushing = true;
+  }
+  TRACE_UNLOCK();
+
+  if (flush) trace_flush(flush, flush_len);
+  if (length)  *length  = recorder.total;
+  if (dropped) *dropped = recorder.dropped;
+  return SUCCESS;
+}
+
+/*************************************** reading ******************************************/
+
+static inline bool get_varint(stepper_trace_reader_t * reader, uint64_t * value) {
+  uint64_t result = 0;
+  for (uint32_t shift = 0; shift < 64; shift += 7) {
+    if (reader->offset >= reader->length) return false;
+    uint8_t byte = reader->data[reader->offset++];
+    result |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline bool get_byte(stepper_trace_reader_t * reader, uint8_t * value) {
+  if (reader->offset >= reader->length) return false;
+  *value = reader->data[reader->offset++];
+  return true;
+}
+
+static inline bool get_float(stepper_trace_reader_t * reader, float * value) {
+  if (reader->offset + 4 > reader->length) return false;
+  uint32_t bits = 0;
+  for (int i = 0; i < 4; i++) bits |= (uint32_t) reader->data[reader->offset++] << (8 * i);
+  memcpy(value, &bits, 4);
+  return true;
+}
+
+stepper_err_t stepper_trace_open(stepper_trace_reader_t * reader, uint8_t const * data, size_t length)
+{
+  memset(reader, 0, sizeof(*reader));
+  if (length < STEPPER_TRACE_HEADER_LEN || memcmp(data, STEPPER_TRACE_MAGIC, 4) || data[4] != STEPPER_TRACE_VERSION) {
+    return INVALID_PARAMETERS;
+  }
+  reader->data    = data;
+  reader->length  = length;
+  reader->offset  = STEPPER_TRACE_HEADER_LEN;
+  return SUCCESS;
+}
+
+bool stepper_trace_read(stepper_trace_reader_t * reader, stepper_trace_record_t * record)
+{
+  uint8_t  head  = 0;
+  uint8_t  byte  = 0;
+  uint64_t delta = 0;
+  uint64_t value = 0;
+  if (!get_byte(reader, &head) || !get_varint(reader, &delta)) return false;
+
+  reader->time_us    += (int64_t) delta;
+  record->type        = head & 0x0F;
+  record->instance_id = head >> 4;
+  record->time_ns     = reader->time_us * 1000;
+  record->value       = 0;
+  record->extra       = 0;
+  record->flags          = 0;
+  record->shaper         = 0;
+  record->shaper_freq_hz = 0;
+  record->shaper_damping = 0;
+
+  switch (record->type) {
+    case TRACE_INIT:
+      if (!get_varint(reader, &value)) return false;
+      record->value = (int32_t) value;
+      if (!get_varint(reader, &value)) return false;
+      record->extra = (uint32_t) value;
+      if (!get_byte(reader, &record->flags) || !get_byte(reader, &record->shaper)) return false;
+      if (!get_float(reader, &record->shaper_freq_hz) || !get_float(reader, &record->shaper_damping)) return false;
+      break;
+    case TRACE_RPM:
+      if (!get_varint(reader, &value)) return false;
+      record->value = (int32_t) unzigzag(value);
+      break;
+    case TRACE_DIRECTION:
+      if (!get_byte(reader, &byte)) return false;
+      record->value = byte;
+      break;
+    case TRACE_RATE:
+      if (!get_varint(reader, &value) || !get_byte(reader, &byte)) return false;
+      record->extra = (uint32_t) value;
+      record->value = byte;
+      break;
+    case TRACE_EVENT:
+      if (!get_byte(reader, &byte) || !get_varint(reader, &value)) return false;
+      record->extra = byte;
+      record->value = (int32_t) unzigzag(value);
+      break;
+    case TRACE_START:
+    case TRACE_STOP:
+    case TRACE_END:
+      break;
+    default:
+      return false; // unknown record, can not skip its payload.
+  }
+  return true;
+}
+
+void stepper_trace_config(stepper_trace_record_t const * record, stepper_config_t * config)
+{
+  *config = (stepper_config_t) STEPPER_CONFIG(-1, -1);
+  config->subdivision    = record->value;
+  config->pulse_us       = record->extra;
+  config->dual_edge      = record->flags & STEPPER_TRACE_DUAL_EDGE;
+  config->shaper         = (stepper_shaper_type_t) record->shaper;
+  config->shaper_freq_hz = record->shaper_freq_hz;
+  config->shaper_damping = record->shaper_damping;
+}
+
+bool stepper_trace_next(stepper_trace_reader_t * reader, stepper_trace_record_t * record)
+{
+  if (!reader->has_pending) {
+    reader->has_pending = stepper_trace_read(reader, &reader->pending);
+    if (!reader->has_pending) return false;
+  }
+
+  // earliest edge not after the pending record.
+  int     edge = -1;
+  int64_t time = reader->pending.time_ns;
+  for (int i = 0; i < STEPPER_TRACE_MAX_INSTANCE; i++) {
+    if (reader->running[i] && reader->next_ns[i] <= time) {
+      edge = i;
+      time = reader->next_ns[i];
+    }
+  }
+  if (edge > -1) {
+    record->type        = TRACE_EDGE;
+    record->instance_id = edge;
+    record->time_ns     = time;
+    record->value       = reader->direction[edge];
+    record->extra       = reader->period_ns[edge];
+    reader->next_ns[edge] += reader->period_ns[edge];
+    return true;
+  }
+
+  stepper_trace_record_t * pending = &reader->pending;
+  uint8_t id = pending->instance_id;
+  switch (pending->type) {
+    case TRACE_RATE: {
+      uint32_t period_ns = pending->extra;
+      int64_t  left_ns   = reader->running[id] ? reader->next_ns[id] - pending->time_ns : reader->next_ns[id];
+      if ((pending->value & STEPPER_TRACE_RESTART) || reader->period_ns[id] == 0) {
+        left_ns = period_ns;  // a new period from now, also the first one.
+      } else if (period_ns && period_ns != reader->period_ns[id]) {
+        left_ns = left_ns * period_ns / reader->period_ns[id];  // the same part of a step, at the new rate.
+      }
+      if (period_ns) {
+        reader->next_ns[id]   = pending->time_ns + left_ns;
+        reader->period_ns[id] = period_ns;
+      } else {
+        reader->next_ns[id]   = left_ns;  // kept with its period until the output runs again.
+      }
+      reader->running[id]   = period_ns > 0;
+      reader->direction[id] = pending->value & 1;
+      break;
+    }
+    case TRACE_DIRECTION:
+      reader->direction[id] = pending->value;
+      break;
+    default:
+      break;
+  }
+  *record = *pending;
+  reader->has_pending = false;
+  return true;
+}
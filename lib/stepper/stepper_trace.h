@@ -0,0 +1,158 @@
+#ifndef STEPPER_TRACE_H__
+#define STEPPER_TRACE_H__
+
+#include <stddef.h>
+#include "stepper.h"
+
+/**
+ * binary motion trace.
+ *
+ * build with `STEPPER_TRACE` defined to record, otherwise every hook below compiles to nothing.
+ *
+ * the stream starts with `STEPPER_TRACE_MAGIC` and a version byte, followed by records:
+ *   - 1 byte   `type | (instance_id << 4)`
+ *   - varint   microseconds since the previous record
+ *   - payload  depends on type, see `stepper_trace_type_t`.
+ *
+ * the step peripherals (LEDC / PWM) run without cpu, so steps are not recorded one by one. every time
+ * the driver programs a peripheral a `TRACE_RATE` record holds the real period it produces, and the
+ * step edges are reconstructed from those by `stepper_trace_next`, the same way on every host.
+*/
+
+#define STEPPER_TRACE_MAGIC       "STPT"
+#define STEPPER_TRACE_VERSION     4
+#define STEPPER_TRACE_RESTART     0x02  // TRACE_RATE: the output restarted its period, instead of keeping the phase.
+#define STEPPER_TRACE_DUAL_EDGE   0x01  // TRACE_INIT flags: `config.dual_edge`.
+#define STEPPER_TRACE_HEADER_LEN  8     // magic, version, 3 bytes reserved.
+
+typedef enum {
+  TRACE_INIT = 1,     // varint subdivision, varint pulse_us, 1 byte flags, 1 byte shaper, float32 freq_hz, float32 damping.
+  TRACE_RPM,          // zigzag varint rpm, in 1/1000 rpm.
+  TRACE_DIRECTION,    // 1 byte direction.
+  TRACE_START,
+  TRACE_STOP,
+  TRACE_RATE,         // varint period_ns (0 means no output), 1 byte direction | `STEPPER_TRACE_RESTART`.
+  TRACE_EVENT,        // 1 byte `stepper_event_t`, zigzag varint following error.
+  TRACE_END,          // end of recording.
+  TRACE_EDGE = 15,    // not stored, produced by `stepper_trace_next`.
+} stepper_trace_type_t;
+
+/**
+ * @brief called whenever one half of the RAM buffer is full and when the recording stops, from the
+ *        caller context of the traced API (may be an interrupt). the trace lock is not held, the other
+ *        half keeps recording meanwhile, records are dropped only when it fills before the sink returns.
+*/
+typedef void (*stepper_trace_sink_t)(void * context, uint8_t const * data, uint32_t length);
+
+/**
+ * @brief start recording into `buffer`.
+ *
+ * @param buffer  RAM buffer, keeps the whole trace when `sink` is NULL, else split in two halves, one
+ *                records while the other is flushed to `sink`.
+ * @param size    at least 64 bytes.
+ * @param sink    optional, receives the trace in chunks.
+ * @param context passed to `sink`.
+ *
+ * @return
+ *    - SUCCESS             start successfully.
+ *    - INVALID_PARAMETERS  buffer is too small.
+ *    - INVALID_STATE       already recording, or built without `STEPPER_TRACE`.
+*/
+stepper_err_t stepper_trace_start(uint8_t * buffer, uint32_t size, stepper_trace_sink_t sink, void * context);
+
+/**
+ * @brief stop recording, and flush the rest into the sink. call it from the recording task, not from an
+ *        interrupt which may preempt a running flush.
+ *
+ * @param length  optional output, number of bytes kept in `buffer` (without sink) or sent to the sink.
+ * @param dropped optional output, number of records dropped since the RAM buffer was full.
+ *
+ * @return
+ *    - SUCCESS             stop successfully.
+ *    - INVALID_STATE       not recording.
+*/
+stepper_err_t stepper_trace_stop(uint64_t * length, uint32_t * dropped);
+
+/*********************************** recording hooks **************************************/
+
+void stepper_trace_init(uint8_t instance_id, int64_t now_us, stepper_config_t const * config);
+void stepper_trace_api(uint8_t type, uint8_t instance_id, int64_t now_us, int32_t value, uint32_t extra);
+void stepper_trace_rate(uint8_t instance_id, int64_t now_us, uint32_t period_ns, bool direction, bool restart);
+void stepper_trace_event(uint8_t instance_id, int64_t now_us, uint8_t event, int32_t error);
+
+#if defined(STEPPER_TRACE)
+#define TRACE_CONFIG(id_, now_, config_)            stepper_trace_init(id_, now_, config_)
+#define TRACE_API(type_, id_, now_, value_, extra_) stepper_trace_api(type_, id_, now_, value_, extra_)
+#define TRACE_RATE(id_, now_, period_ns_, dir_, restart_) \
+                                                    stepper_trace_rate(id_, now_, period_ns_, dir_, restart_)
+#define TRACE_FEEDBACK(id_, now_, event_, error_)   stepper_trace_event(id_, now_, event_, error_)
+#else
+#define TRACE_CONFIG(id_, now_, config_)
+#define TRACE_API(type_, id_, now_, value_, extra_)
+#define TRACE_RATE(id_, now_, period_ns_, dir_, restart_)
+#define TRACE_FEEDBACK(id_, now_, event_, error_)
+#endif
+
+/*************************************** reading ******************************************/
+
+#define STEPPER_TRACE_MAX_INSTANCE  16
+
+typedef struct {
+  uint8_t  type;          // `stepper_trace_type_t`.
+  uint8_t  instance_id;
+  int64_t  time_ns;       // since the recording started.
+  int32_t  value;         // TRACE_INIT: subdivision, TRACE_RPM: 1/1000 rpm, TRACE_DIRECTION / TRACE_EDGE: direction,
+                          // TRACE_RATE: direction | `STEPPER_TRACE_RESTART`, TRACE_EVENT: following error.
+  uint32_t extra;         // TRACE_INIT: pulse_us, TRACE_RATE: period_ns, TRACE_EVENT: `stepper_event_t`.
+  // TRACE_INIT only, the rest of the config that changes the edges, see `stepper_trace_config`.
+  uint8_t  flags;         // `STEPPER_TRACE_DUAL_EDGE`.
+  uint8_t  shaper;        // `stepper_shaper_type_t`.
+  float    shaper_freq_hz;
+  float    shaper_damping;
+} stepper_trace_record_t;
+
+typedef struct {
+  uint8_t const * data;
+  size_t          length;
+  size_t          offset;
+  int64_t         time_us;
+  // edge reconstruction.
+  stepper_trace_record_t  pending;
+  bool                    has_pending;
+  int64_t                 next_ns[STEPPER_TRACE_MAX_INSTANCE];    // while stopped: time left to the next edge.
+  uint32_t                period_ns[STEPPER_TRACE_MAX_INSTANCE];
+  bool                    direction[STEPPER_TRACE_MAX_INSTANCE];
+  bool                    running[STEPPER_TRACE_MAX_INSTANCE];
+} stepper_trace_reader_t;
+
+/**
+ * @brief check the header, and prepare to read `data`.
+ *
+ * @return
+ *    - SUCCESS             valid trace.
+ *    - INVALID_PARAMETERS  not a trace, or unsupported version.
+*/
+stepper_err_t stepper_trace_open(stepper_trace_reader_t * reader, uint8_t const * data, size_t length);
+
+/**
+ * @brief read the next stored record, or `false` at the end (or a truncated record).
+*/
+bool stepper_trace_read(stepper_trace_reader_t * reader, stepper_trace_record_t * record);
+
+/**
+ * @brief the config recorded by `TRACE_INIT`, to replay the trace: pins are left unconnected, the
+ *        fields that change the emitted edges are the recorded ones.
+*/
+void stepper_trace_config(stepper_trace_record_t const * record, stepper_config_t * config);
+
+/**
+ * @brief read the next record or reconstructed `TRACE_EDGE`, in time order.
+ *
+ * the edges follow the `TRACE_RATE` records only. a new period keeps the phase, i.e. the part of the
+ * current step left is emitted at the new rate, as the position accounting of the backends counts it,
+ * also across a stop. with `STEPPER_TRACE_RESTART` the first edge comes one full period later.
+ * `TRACE_DIRECTION` applies to the following edges. edges stop at the last record.
+*/
+bool stepper_trace_next(stepper_trace_reader_t * reader, stepper_trace_record_t * record);
+
+#endif // STEPPER_TRACE_H__
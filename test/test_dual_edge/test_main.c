@@ -0,0 +1,93 @@
+#include <unity.h>
+
+#include "stepper.h"
+#include "stepper_soft.h"
+#include "stepper_trace.h"
+
+// dual-edge on the soft backend: the step rate is rounded down to even steps, a step must not be
+// shorter than `pulse_us`, and the reported position is what the output emitted.
+
+static const stepper_t stepper0 = STEPPER_INSTANCE(0);
+
+static uint8_t  trace[16 * 1024];
+
+static int32_t position(void) {
+  int32_t value = 0;
+  stepper_get_position(&stepper0, &value);
+  return value;
+}
+
+static void run_ms(int64_t ms) {
+  stepper_soft_set_time(stepper_now_us() + ms * 1000);
+}
+
+void setUp(void) {
+  // subdivision 60: the step rate in Hz is the rpm.
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.subdivision = 60;
+  config.pulse_us    = 5;
+  config.dual_edge   = true;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, &config));
+  stepper_update_direction(&stepper0, true);
+}
+
+void tearDown(void) {
+  stepper_uninit(&stepper0);
+}
+
+static void test_odd_rate_rounds_to_even_steps(void) {
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_update_rpm(&stepper0, 1001));
+  stepper_start(&stepper0);
+  TEST_ASSERT_EQUAL_UINT32(STEPPER_SOFT_CLOCK_HZ / 1000, stepper_soft_periphs[0].regs.top);
+  run_ms(1000);
+  TEST_ASSERT_INT32_WITHIN(1, 1000, position());
+}
+
+static void test_pulse_width_bounds_the_rate(void) {
+  stepper_start(&stepper0);
+  // 5us steps: 200kHz at most, 200001Hz rounds down to it.
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_update_rpm(&stepper0, 200000));
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_update_rpm(&stepper0, 200001));
+  uint32_t top = stepper_soft_periphs[0].regs.top;
+  TEST_ASSERT_EQUAL(FREQUENCY_UPDATE_ERROR, stepper_update_rpm(&stepper0, 200002));
+  TEST_ASSERT_EQUAL_UINT32(top, stepper_soft_periphs[0].regs.top);  // the output keeps its rate.
+  run_ms(10);
+  TEST_ASSERT_INT32_WITHIN(1, 2000, position());
+}
+
+static void test_position_follows_edges(void) {
+  // odd rates, rounded down to ones the 16MHz timer of the mock has no rounding error for.
+  static const float rates[] = { 1001, 2501, 8001, 1251, 5001, 3201, 10001, 1601, 4001, 6401 };
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_start(trace, sizeof(trace), NULL, NULL));
+  stepper_start(&stepper0);
+  for (int i = 0; i < 40; i++) {
+    stepper_update_rpm(&stepper0, rates[i % 10]);
+    if (i % 9 == 4) stepper_update_direction(&stepper0, i & 1);
+    stepper_soft_set_time(stepper_now_us() + 1700 + i * 113);
+  }
+  int32_t reported = position();
+  uint64_t length = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(&length, NULL));
+  TEST_ASSERT_INT32_WITHIN(1, reported, stepper_track_position(&stepper_soft_periphs[0].output, stepper_now_us()));
+
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int32_t edges = 0;
+  int32_t total = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&reader, trace, (size_t) length));
+  while (stepper_trace_next(&reader, &record)) {
+    if (record.type != TRACE_EDGE) continue;
+    edges += record.value ? 1 : -1;
+    total++;
+  }
+  TEST_ASSERT_GREATER_THAN(500, total);
+  TEST_ASSERT_INT32_WITHIN(1, reported, edges);
+}
+
+int main(int argc, char ** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_odd_rate_rounds_to_even_steps);
+  RUN_TEST(test_pulse_width_bounds_the_rate);
+  RUN_TEST(test_position_follows_edges);
+  return UNITY_END();
+}
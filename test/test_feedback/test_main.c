@@ -0,0 +1,164 @@
+#include <unity.h>
+
+#include "stepper.h"
+#include "stepper_feedback.h"
+#include "stepper_soft.h"
+
+// closed-loop feedback on the soft backend: steps are skipped by the mocked motor, its encoder
+// reports them, and the backend trims, stalls and rebases as the mcu backends do.
+
+static const stepper_t stepper0 = STEPPER_INSTANCE(0);
+
+static int     events[3];     // count per `stepper_event_t`.
+static int32_t last_error;
+
+static void on_event(stepper_t const * stepper, stepper_event_t event, int32_t following_error) {
+  events[event]++;
+  last_error = following_error;
+}
+
+static void run_ms(int64_t ms) {
+  stepper_soft_set_time(stepper_now_us() + ms * 1000);
+}
+
+static int32_t position(void) {
+  int32_t value = 0;
+  stepper_get_position(&stepper0, &value);
+  return value;
+}
+
+static int32_t following_error(void) {
+  int32_t value = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_get_following_error(&stepper0, &value));
+  return value;
+}
+
+void setUp(void) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.subdivision      = 3200;
+  config.pin_enc_a        = 4;
+  config.pin_enc_b        = 5;
+  config.encoder_cpr      = 4000;
+  config.correction_steps = 8;
+  config.stall_steps      = 200;
+  config.event_handler    = on_event;
+  events[0] = events[1] = events[2] = 0;
+  stepper_init(&stepper0, &config);
+  stepper_update_direction(&stepper0, true);
+  stepper_update_rpm(&stepper0, 60);  // 3200 steps/s.
+  run_ms(100);
+}
+
+void tearDown(void) {
+  stepper_uninit(&stepper0);
+}
+
+static void test_no_error_without_skipped_steps(void) {
+  TEST_ASSERT_INT32_WITHIN(1, 0, following_error());
+  TEST_ASSERT_EQUAL(0, events[STEPPER_EVENT_CORRECTION]);
+  TEST_ASSERT_EQUAL_UINT32(3200, stepper_soft_periphs[0].output.freq_hz);
+}
+
+static void test_trim_catches_up_skipped_steps(void) {
+  stepper_soft_skip_steps(&stepper0, 40);
+  run_ms(2);
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_CORRECTION]);
+  TEST_ASSERT_GREATER_THAN_UINT32(3200, stepper_soft_periphs[0].output.freq_hz);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(3200 * 3 / 2, stepper_soft_periphs[0].output.freq_hz);
+
+  run_ms(100);
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_RECOVERED]);
+  TEST_ASSERT_EQUAL_UINT32(3200, stepper_soft_periphs[0].output.freq_hz);
+  TEST_ASSERT_INT32_WITHIN(4, 0, following_error());
+}
+
+static void test_trim_follows_backwards(void) {
+  stepper_update_direction(&stepper0, false);
+  run_ms(100);
+  stepper_soft_skip_steps(&stepper0, -40);
+  run_ms(100);
+  TEST_ASSERT_GREATER_OR_EQUAL(1, events[STEPPER_EVENT_CORRECTION]);  // once per trim update.
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_RECOVERED]);
+  TEST_ASSERT_INT32_WITHIN(4, 0, following_error());
+}
+
+static void test_stop_while_trimming_stays_stopped(void) {
+  stepper_soft_skip_steps(&stepper0, 40);
+  run_ms(2);
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_CORRECTION]);
+
+  stepper_stop(&stepper0);
+  int32_t stopped_at = position();
+  run_ms(50);
+  TEST_ASSERT_FALSE(stepper_soft_periphs[0].output.running);
+  TEST_ASSERT_EQUAL_INT32(stopped_at, position());
+  TEST_ASSERT_EQUAL(0, events[STEPPER_EVENT_RECOVERED]);  // nothing recovered, the output stopped.
+  TEST_ASSERT_EQUAL(0, stepper_feedbacks[0].trim_hz);
+}
+
+static void test_trim_bounded_by_lower_rate(void) {
+  stepper_soft_skip_steps(&stepper0, -100);  // far ahead, trimmed down by half of 3200 steps/s.
+  run_ms(2);
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_CORRECTION]);
+  TEST_ASSERT_EQUAL_UINT32(1600, stepper_soft_periphs[0].output.freq_hz);
+
+  stepper_update_rpm(&stepper0, 10);  // 533 steps/s, the trim sampled at 3200 steps/s is stale.
+  TEST_ASSERT_GREATER_OR_EQUAL(533 - 533 / 2, stepper_soft_periphs[0].output.freq_hz);
+  TEST_ASSERT_LESS_OR_EQUAL(533 + 533 / 2, stepper_soft_periphs[0].output.freq_hz);
+}
+
+static void test_feedback_freq_clamps_stale_trim(void) {
+  stepper_feedback_t feedback = { .trim_hz = -3125 };
+  stepper_track_t    track    = { .freq_hz = 1000, .direction = true, .running = true };
+  TEST_ASSERT_EQUAL_UINT32(500, stepper_feedback_freq(&feedback, &track));
+  track.direction = false;
+  TEST_ASSERT_EQUAL_UINT32(1500, stepper_feedback_freq(&feedback, &track));
+  track.freq_hz = 0;
+  TEST_ASSERT_EQUAL_UINT32(0, stepper_feedback_freq(&feedback, &track));
+}
+
+static void test_track_counts_edges_across_reversal(void) {
+  stepper_track_t track = { 0 };
+  stepper_track_set(&track, 0, 1000, false, true);      // 1 step per ms, backwards.
+  TEST_ASSERT_EQUAL_INT32(0, stepper_track_position(&track, 999));
+  TEST_ASSERT_EQUAL_INT32(-1, stepper_track_position(&track, 1000));
+  // reversed 0.3 step after an edge: the output still has 0.7 step to its next edge.
+  stepper_track_set(&track, 1300, 1000, true, true);
+  TEST_ASSERT_EQUAL_INT32(-1, stepper_track_position(&track, 1999));
+  TEST_ASSERT_EQUAL_INT32(0, stepper_track_position(&track, 2000));
+  TEST_ASSERT_EQUAL_INT32(1, stepper_track_position(&track, 3000));
+}
+
+static void test_stall_stops_and_start_rebases(void) {
+  stepper_soft_skip_steps(&stepper0, 400);
+  run_ms(2);
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_STALL]);
+  TEST_ASSERT_GREATER_THAN(200, last_error);
+  TEST_ASSERT_FALSE(stepper_soft_periphs[0].output.running);
+
+  int32_t stopped_at = position();
+  run_ms(50);
+  TEST_ASSERT_EQUAL_INT32(stopped_at, position());
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_STALL]);  // latched, not raised again.
+
+  // resume from where the motor really is.
+  stepper_start(&stepper0);
+  TEST_ASSERT_INT32_WITHIN(1, stopped_at - 400, position());
+  run_ms(50);
+  TEST_ASSERT_INT32_WITHIN(2, 0, following_error());  // rebased on a count, 0.8 step each.
+  TEST_ASSERT_EQUAL(1, events[STEPPER_EVENT_STALL]);
+  TEST_ASSERT_EQUAL(0, events[STEPPER_EVENT_CORRECTION]);
+}
+
+int main(int argc, char ** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_no_error_without_skipped_steps);
+  RUN_TEST(test_trim_catches_up_skipped_steps);
+  RUN_TEST(test_trim_follows_backwards);
+  RUN_TEST(test_stop_while_trimming_stays_stopped);
+  RUN_TEST(test_trim_bounded_by_lower_rate);
+  RUN_TEST(test_feedback_freq_clamps_stale_trim);
+  RUN_TEST(test_track_counts_edges_across_reversal);
+  RUN_TEST(test_stall_stops_and_start_rebases);
+  return UNITY_END();
+}
@@ -0,0 +1,167 @@
+#include <unity.h>
+
+#include "stepper.h"
+#include "stepper_soft.h"
+#include "stepper_trace.h"
+
+// low-power idle on the soft backend: the mocked step peripheral runs again only a settable latency
+// after the wake-up, and the idle statistics must report that latency, not the time of the call.
+// the register restore of the ESP32 / nRF52 backends is not played here, only the accounting of it.
+
+// wake-up budget, from the call to the step output running again: the mocked peripherals stay below it.
+#define WAKE_LATENCY_BOUND_US   500
+// 60rpm at 3200 steps per round.
+#define STEP_PERIOD_NS          312500
+
+static const stepper_t stepper0 = STEPPER_INSTANCE(0);
+
+static uint8_t  trace[4 * 1024];
+
+static void run_us(int64_t us) {
+  stepper_soft_set_time(stepper_now_us() + us);
+}
+
+static stepper_idle_stats_t idle_stats(void) {
+  stepper_idle_stats_t stats;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_get_idle_stats(&stepper0, &stats));
+  return stats;
+}
+
+// runs, stops and waits until the hold time expired.
+static void go_idle(void) {
+  stepper_start(&stepper0);
+  run_us(5000);
+  stepper_stop(&stepper0);
+  run_us(20000);
+  TEST_ASSERT_TRUE(idle_stats().idle);
+}
+
+static void init(uint32_t latency_us) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.rpm          = 60;
+  config.pin_enable   = 3;
+  config.idle_hold_ms = 10;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, &config));
+  stepper_soft_set_wake_latency(&stepper0, latency_us);
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+  stepper_uninit(&stepper0);
+  stepper_soft_set_wake_latency(&stepper0, 0);
+}
+
+static void test_latency_of_the_peripheral_is_measured(void) {
+  init(250);
+  go_idle();
+  stepper_start(&stepper0);
+  run_us(200);
+  TEST_ASSERT_FALSE(stepper_soft_periphs[0].output.running);  // still waking up.
+  TEST_ASSERT_EQUAL_UINT32(0, idle_stats().wake_count);
+  run_us(100);
+  TEST_ASSERT_TRUE(stepper_soft_periphs[0].output.running);
+
+  stepper_idle_stats_t stats = idle_stats();
+  TEST_ASSERT_FALSE(stats.idle);
+  TEST_ASSERT_EQUAL_UINT32(1, stats.wake_count);
+  TEST_ASSERT_EQUAL_UINT32(250, stats.wake_latency_us);
+  TEST_ASSERT_EQUAL_UINT32(250, stats.wake_latency_max_us);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(WAKE_LATENCY_BOUND_US, stats.wake_latency_max_us);
+}
+
+static void test_first_edge_follows_the_latency(void) {
+  init(250);
+  go_idle();
+  // the recording starts with the wake-up call, its times are the time since.
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_start(trace, sizeof(trace), NULL, NULL));
+  stepper_start(&stepper0);
+  run_us(2000);
+  uint64_t length = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(&length, NULL));
+
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int64_t first_ns = -1;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&reader, trace, (size_t) length));
+  while (stepper_trace_next(&reader, &record)) {
+    if (record.type == TRACE_EDGE) { first_ns = record.time_ns; break; }
+  }
+  // no step while waking up, then the restarted output steps after one full period.
+  TEST_ASSERT_EQUAL_INT64(250 * 1000 + STEP_PERIOD_NS, first_ns);
+
+  stepper_idle_stats_t stats = idle_stats();
+  TEST_ASSERT_EQUAL_UINT32(250, stats.wake_latency_us);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(WAKE_LATENCY_BOUND_US, stats.wake_latency_max_us);
+}
+
+static void test_latest_and_max_latency(void) {
+  init(400);
+  go_idle();
+  stepper_start(&stepper0);
+  run_us(1000);
+  stepper_soft_set_wake_latency(&stepper0, 150);
+  go_idle();
+  stepper_update_rpm(&stepper0, 120);  // wakes up as a start does.
+  run_us(1000);
+
+  stepper_idle_stats_t stats = idle_stats();
+  TEST_ASSERT_EQUAL_UINT32(2, stats.wake_count);
+  TEST_ASSERT_EQUAL_UINT32(150, stats.wake_latency_us);
+  TEST_ASSERT_EQUAL_UINT32(400, stats.wake_latency_max_us);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(WAKE_LATENCY_BOUND_US, stats.wake_latency_max_us);
+}
+
+static void test_stop_while_waking_keeps_output_stopped(void) {
+  init(500);
+  go_idle();
+  stepper_start(&stepper0);
+  run_us(100);
+  stepper_stop(&stepper0);
+  run_us(1000);
+  TEST_ASSERT_FALSE(stepper_soft_periphs[0].output.running);
+  TEST_ASSERT_EQUAL_UINT32(0, stepper_soft_periphs[0].regs.top);  // not started once ready.
+}
+
+static void test_no_latency_wakes_at_once(void) {
+  init(0);
+  go_idle();
+  stepper_start(&stepper0);
+  TEST_ASSERT_TRUE(stepper_soft_periphs[0].output.running);
+  TEST_ASSERT_EQUAL_UINT32(0, idle_stats().wake_latency_us);
+}
+
+static void test_dual_edge_idle_needs_enable_pin(void) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.dual_edge    = true;
+  config.idle_hold_ms = 10;
+  TEST_ASSERT_EQUAL(INVALID_PARAMETERS, stepper_init(&stepper0, &config));
+  config.pin_enable   = 3;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, &config));
+}
+
+static void test_hold_time_must_fit_in_microseconds(void) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.idle_hold_ms = STEPPER_IDLE_HOLD_MS_MAX + 1;  // would wrap to 704us.
+  TEST_ASSERT_EQUAL(INVALID_PARAMETERS, stepper_init(&stepper0, &config));
+  config.idle_hold_ms = STEPPER_IDLE_HOLD_MS_MAX;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, &config));
+  stepper_start(&stepper0);
+  run_us(1000);
+  stepper_stop(&stepper0);
+  run_us(1000 * 1000);
+  TEST_ASSERT_FALSE(idle_stats().idle);  // still holding.
+}
+
+int main(int argc, char ** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_latency_of_the_peripheral_is_measured);
+  RUN_TEST(test_first_edge_follows_the_latency);
+  RUN_TEST(test_latest_and_max_latency);
+  RUN_TEST(test_stop_while_waking_keeps_output_stopped);
+  RUN_TEST(test_no_latency_wakes_at_once);
+  RUN_TEST(test_dual_edge_idle_needs_enable_pin);
+  RUN_TEST(test_hold_time_must_fit_in_microseconds);
+  return UNITY_END();
+}
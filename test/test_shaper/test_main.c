@@ -0,0 +1,121 @@
+#include <unity.h>
+
+#include "stepper.h"
+#include "stepper_shaper.h"
+#include "stepper_soft.h"
+
+// input shaping keeps the step count, also with more changes in flight than its history holds.
+
+static const stepper_t stepper0 = STEPPER_INSTANCE(0);
+
+// integral of the output from `from_us` until settled, played from one output change to the next,
+// in 1/1000000 step.
+static int64_t output_integral(stepper_shaper_t const * shaper, int64_t from_us) {
+  int64_t sum    = 0;
+  int64_t now_us = from_us;
+  int64_t next_us = 0;
+  while (stepper_shaper_next(shaper, now_us, &next_us)) {
+    sum += (int64_t) stepper_shaper_output(shaper, now_us) * (next_us - now_us);
+    now_us = next_us;
+  }
+  TEST_ASSERT_EQUAL_INT32(0, stepper_shaper_output(shaper, now_us));  // settled on a stop.
+  return sum;
+}
+
+// feeds `changes` inputs every `interval_us`, back to 0 at the end, returns the integral of the output
+// minus the integral of the input, in 1/1000 step.
+static int32_t step_error(stepper_shaper_type_t type, float freq_hz, int changes, int64_t interval_us, bool zigzag) {
+  stepper_shaper_t shaper;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_shaper_init(&shaper, type, freq_hz, 0.1f));
+
+  int64_t input   = 0;
+  int64_t output  = 0;
+  int64_t now_us  = 1000;
+  int32_t velocity = 0;
+  for (int i = 0; i <= changes; i++) {
+    int32_t next = i == changes ? 0 : (zigzag ? (i & 1 ? 800 : 2400 + i * 7) : 100 + i * 37);
+    // output emitted until this change, the shaper is applied at each of its own changes as the backends do.
+    int64_t at_us = now_us - interval_us;
+    int64_t next_us = 0;
+    while (i && stepper_shaper_next(&shaper, at_us, &next_us) && next_us < now_us) {
+      output += (int64_t) stepper_shaper_output(&shaper, at_us) * (next_us - at_us);
+      at_us = next_us;
+    }
+    if (i) output += (int64_t) stepper_shaper_output(&shaper, at_us) * (now_us - at_us);
+
+    int32_t before = stepper_shaper_output(&shaper, now_us - 1);
+    stepper_shaper_input(&shaper, now_us, next);
+    if (i) input += (int64_t) velocity * interval_us;
+    velocity = next;
+    // a merge never changes what was emitted up to now.
+    TEST_ASSERT_EQUAL_INT32(before, stepper_shaper_output(&shaper, now_us - 1));
+    now_us += interval_us;
+  }
+  output += output_integral(&shaper, now_us - interval_us);
+  return (int32_t)((output - input) / 1000);
+}
+
+static void test_shaper_keeps_integral_within_history(void) {
+  TEST_ASSERT_INT32_WITHIN(100, 0, step_error(STEPPER_SHAPER_ZVD, 30, 8, 5000, false));
+}
+
+static void test_shaper_keeps_integral_beyond_history(void) {
+  // 1ms apart, ZVD at 10Hz keeps each change for ~100ms: ~100 in flight for 16 slots.
+  TEST_ASSERT_INT32_WITHIN(100, 0, step_error(STEPPER_SHAPER_ZVD, 10, 300, 1000, false));
+  TEST_ASSERT_INT32_WITHIN(100, 0, step_error(STEPPER_SHAPER_ZV,  10, 300, 1000, false));
+  TEST_ASSERT_INT32_WITHIN(100, 0, step_error(STEPPER_SHAPER_EI,   5, 300, 700,  false));
+}
+
+static void test_shaper_keeps_integral_zigzag(void) {
+  // not monotonic: merged into averages, not by moving a change.
+  TEST_ASSERT_INT32_WITHIN(100, 0, step_error(STEPPER_SHAPER_ZVD, 10, 300, 1300, true));
+  TEST_ASSERT_INT32_WITHIN(100, 0, step_error(STEPPER_SHAPER_EI,  30, 300, 100,  true));
+}
+
+// ramp up, hold and stop on the soft backend, returns the position once settled.
+static int32_t ramp_steps(stepper_shaper_type_t type, float freq_hz) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.subdivision    = 3200;
+  config.shaper         = type;
+  config.shaper_freq_hz = freq_hz;
+  config.shaper_damping = 0.05f;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, &config));
+  stepper_update_direction(&stepper0, true);
+  stepper_start(&stepper0);
+  for (int rpm = 1; rpm <= 100; rpm++) {
+    stepper_update_rpm(&stepper0, rpm);
+    stepper_soft_set_time(stepper_now_us() + 2000);
+  }
+  stepper_soft_set_time(stepper_now_us() + 200000);
+  stepper_stop(&stepper0);
+  stepper_soft_set_time(stepper_now_us() + 1000000);
+
+  int32_t position = 0;
+  stepper_get_position(&stepper0, &position);
+  stepper_uninit(&stepper0);
+  return position;
+}
+
+static void test_shaped_ramp_keeps_step_count(void) {
+  int32_t unshaped = ramp_steps(STEPPER_SHAPER_NONE, 0);
+  TEST_ASSERT_GREATER_THAN(1000, unshaped);
+  TEST_ASSERT_INT32_WITHIN(1, unshaped, ramp_steps(STEPPER_SHAPER_ZV,  30));
+  TEST_ASSERT_INT32_WITHIN(1, unshaped, ramp_steps(STEPPER_SHAPER_ZVD, 30));
+  TEST_ASSERT_INT32_WITHIN(1, unshaped, ramp_steps(STEPPER_SHAPER_ZVD, 10));
+  TEST_ASSERT_INT32_WITHIN(1, unshaped, ramp_steps(STEPPER_SHAPER_EI,  10));
+}
+
+void setUp(void) {
+}
+
+void tearDown(void) {
+}
+
+int main(int argc, char ** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_shaper_keeps_integral_within_history);
+  RUN_TEST(test_shaper_keeps_integral_beyond_history);
+  RUN_TEST(test_shaper_keeps_integral_zigzag);
+  RUN_TEST(test_shaped_ramp_keeps_step_count);
+  return UNITY_END();
+}
@@ -0,0 +1,293 @@
+#include <unity.h>
+#include <string.h>
+
+#include "stepper.h"
+#include "stepper_soft.h"
+#include "stepper_trace.h"
+
+// recording on the soft backend, and edge reconstruction: the edges read back must add up to the
+// position the backend reports, whatever the rate changes in between.
+
+static const stepper_t stepper0 = STEPPER_INSTANCE(0);
+
+static uint8_t  staging[256];
+static uint8_t  stream[64 * 1024];
+static uint32_t stream_len;
+static uint8_t  recorded[64 * 1024];  // the original of a replay.
+static uint32_t recorded_len;
+static uint32_t largest_chunk;
+
+static void memory_sink(void * context, uint8_t const * data, uint32_t length) {
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(sizeof(stream), stream_len + length);
+  memcpy(&stream[stream_len], data, length);
+  stream_len += length;
+  if (length > largest_chunk) largest_chunk = length;
+}
+
+static void run_ms(int64_t ms) {
+  stepper_soft_set_time(stepper_now_us() + ms * 1000);
+}
+
+static int32_t position(void) {
+  int32_t value = 0;
+  stepper_get_position(&stepper0, &value);
+  return value;
+}
+
+// sum of the reconstructed edges of instance 0.
+static int32_t edge_position(void) {
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int32_t steps = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&reader, stream, stream_len));
+  while (stepper_trace_next(&reader, &record)) {
+    if (record.type == TRACE_EDGE && record.instance_id == 0) steps += record.value ? 1 : -1;
+  }
+  return steps;
+}
+
+static int64_t trace_t0_us;
+static int32_t busy_ms;  // time of the latest record written by `rpm_at`.
+
+// a record at `ms` since the recording started, holding its own time.
+static void rpm_at(int32_t ms) {
+  stepper_trace_api(TRACE_RPM, 0, trace_t0_us + ms * 1000, ms, 0);
+}
+
+// a slow sink: records keep coming while it runs, the other half overflows and drops them.
+static void busy_sink(void * context, uint8_t const * data, uint32_t length) {
+  memory_sink(context, data, length);
+  for (int i = 0; i < 16 && busy_ms < 200; i++) rpm_at(++busy_ms);
+}
+
+static void record_start(void) {
+  stream_len    = 0;
+  largest_chunk = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_start(staging, sizeof(staging), memory_sink, NULL));
+}
+
+void setUp(void) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.subdivision = 3200;
+  record_start();
+  stepper_init(&stepper0, &config);
+}
+
+void tearDown(void) {
+  stepper_uninit(&stepper0);
+  stepper_trace_stop(NULL, NULL);
+}
+
+static void test_edges_follow_rate_changes(void) {
+  stepper_update_direction(&stepper0, true);
+  stepper_start(&stepper0);
+  // odd periods and short segments, every change lands in the middle of a step.
+  for (int i = 0; i < 40; i++) {
+    stepper_update_rpm(&stepper0, 3.7f + i * 1.3f);
+    stepper_soft_set_time(stepper_now_us() + 1700 + i * 113);
+  }
+  int32_t reported = position();
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(NULL, NULL));
+  TEST_ASSERT_INT32_WITHIN(1, reported, edge_position());
+}
+
+static void test_edges_across_stop_and_direction(void) {
+  stepper_update_rpm(&stepper0, 7);
+  stepper_start(&stepper0);
+  for (int i = 0; i < 10; i++) {
+    run_ms(13);
+    stepper_stop(&stepper0);
+    run_ms(5);
+    stepper_update_direction(&stepper0, i & 1);
+    stepper_start(&stepper0);
+  }
+  run_ms(13);
+  int32_t reported = position();
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(NULL, NULL));
+  TEST_ASSERT_INT32_WITHIN(1, reported, edge_position());
+}
+
+static void test_restart_starts_a_full_period(void) {
+  int64_t start_us = stepper_now_us();
+  stepper_trace_rate(1, start_us, 1000000, true, false);
+  stepper_soft_set_time(start_us + 2500);
+  stepper_trace_rate(1, stepper_now_us(), 2000000, true, false);  // keeps the phase: half a step left.
+  stepper_soft_set_time(start_us + 5000);
+  stepper_trace_rate(1, stepper_now_us(), 1000000, true, true);   // starts over.
+  stepper_soft_set_time(start_us + 7500);
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(NULL, NULL));
+
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int64_t edges[8];
+  int     count = 0;
+  stepper_trace_open(&reader, stream, stream_len);
+  while (stepper_trace_next(&reader, &record) && count < 8) {
+    if (record.type == TRACE_EDGE && record.instance_id == 1) edges[count++] = record.time_ns;  // since the recording started.
+  }
+  TEST_ASSERT_EQUAL(5, count);
+  TEST_ASSERT_EQUAL_INT64(1000000, edges[0]);
+  TEST_ASSERT_EQUAL_INT64(2000000, edges[1]);
+  TEST_ASSERT_EQUAL_INT64(3500000, edges[2]);
+  TEST_ASSERT_EQUAL_INT64(6000000, edges[3]);  // restarted at 5ms, not carried to 5.25ms.
+  TEST_ASSERT_EQUAL_INT64(7000000, edges[4]);
+}
+
+static void test_sink_gets_halves(void) {
+  stepper_start(&stepper0);
+  for (int i = 0; i < 200; i++) {
+    stepper_update_rpm(&stepper0, 10 + i);
+    run_ms(1);
+  }
+  uint64_t length = 0;
+  uint32_t dropped = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(&length, &dropped));
+  TEST_ASSERT_EQUAL_UINT32(0, dropped);
+  TEST_ASSERT_EQUAL_UINT64(stream_len, length);
+  TEST_ASSERT_LESS_OR_EQUAL_UINT32(sizeof(staging) / 2, largest_chunk);
+
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int rpm_records = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&reader, stream, stream_len));
+  while (stepper_trace_read(&reader, &record)) {
+    if (record.type == TRACE_RPM) rpm_records++;
+  }
+  TEST_ASSERT_EQUAL(200, rpm_records);
+  TEST_ASSERT_EQUAL(TRACE_END, record.type);
+}
+
+// a run with odd rates, direction changes and stops, recorded from its `stepper_init` on.
+static void record_run(stepper_config_t const * config) {
+  stepper_uninit(&stepper0);
+  stepper_trace_stop(NULL, NULL);
+  record_start();
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, config));
+  stepper_update_direction(&stepper0, true);
+  stepper_start(&stepper0);
+  for (int i = 0; i < 30; i++) {
+    stepper_update_rpm(&stepper0, 7 + i * 13 % 97);
+    if (i % 7 == 3) stepper_update_direction(&stepper0, i & 1);
+    if (i % 11 == 5) stepper_stop(&stepper0);
+    if (i % 11 == 8) stepper_start(&stepper0);
+    stepper_soft_set_time(stepper_now_us() + 3000 + i * 211);
+  }
+  stepper_stop(&stepper0);
+  run_ms(200);
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(NULL, NULL));
+  stepper_uninit(&stepper0);
+  memcpy(recorded, stream, stream_len);
+  recorded_len = stream_len;
+}
+
+// the API calls of `recorded` played again on the soft backend, as `trace_analyzer replay` does,
+// recorded into `stream`.
+static void replay(void) {
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int64_t start_us = stepper_now_us();
+  record_start();
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&reader, recorded, recorded_len));
+  while (stepper_trace_read(&reader, &record)) {
+    stepper_soft_set_time(start_us + record.time_ns / 1000);
+    switch (record.type) {
+      case TRACE_INIT: {
+        stepper_config_t config;
+        stepper_trace_config(&record, &config);
+        TEST_ASSERT_EQUAL(SUCCESS, stepper_init(&stepper0, &config));
+        break;
+      }
+      case TRACE_RPM:       stepper_update_rpm(&stepper0, record.value / 1000.0f);  break;
+      case TRACE_DIRECTION: stepper_update_direction(&stepper0, record.value);      break;
+      case TRACE_START:     stepper_start(&stepper0);                               break;
+      case TRACE_STOP:      stepper_stop(&stepper0);                                break;
+      default:              break;
+    }
+  }
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(NULL, NULL));
+}
+
+// the edges of `recorded` and `stream` are the same, returns how many.
+static int same_edges(void) {
+  stepper_trace_reader_t original, replayed;
+  stepper_trace_record_t a, b;
+  int edges = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&original, recorded, recorded_len));
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&replayed, stream, stream_len));
+  for (;;) {
+    bool has_a, has_b;
+    while ((has_a = stepper_trace_next(&original, &a)) && a.type != TRACE_EDGE);
+    while ((has_b = stepper_trace_next(&replayed, &b)) && b.type != TRACE_EDGE);
+    TEST_ASSERT_EQUAL(has_a, has_b);
+    if (!has_a) return edges;
+    TEST_ASSERT_EQUAL_INT64(a.time_ns, b.time_ns);
+    TEST_ASSERT_EQUAL(a.value, b.value);
+    edges++;
+  }
+}
+
+static void test_shaped_replay_is_exact(void) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.subdivision    = 3200;
+  config.shaper         = STEPPER_SHAPER_ZVD;
+  config.shaper_freq_hz = 40;
+  config.shaper_damping = 0.07f;
+  record_run(&config);
+  replay();
+  TEST_ASSERT_GREATER_THAN(200, same_edges());
+}
+
+static void test_dual_edge_replay_is_exact(void) {
+  stepper_config_t config = STEPPER_CONFIG(1, 2);
+  config.subdivision = 3200;
+  config.dual_edge   = true;  // the rate is rounded to even steps, also in the replay.
+  record_run(&config);
+  replay();
+  TEST_ASSERT_GREATER_THAN(200, same_edges());
+
+  config.shaper         = STEPPER_SHAPER_ZV;
+  config.shaper_freq_hz = 25;
+  config.shaper_damping = 0.05f;
+  record_run(&config);
+  replay();
+  TEST_ASSERT_GREATER_THAN(200, same_edges());
+}
+
+static void test_drop_keeps_time_base(void) {
+  uint8_t  small[64];
+  uint32_t dropped = 0;
+  stepper_trace_stop(NULL, NULL);
+  stream_len  = 0;
+  busy_ms     = 0;
+  trace_t0_us = stepper_now_us();
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_start(small, sizeof(small), busy_sink, NULL));
+  while (busy_ms < 200) rpm_at(++busy_ms);
+  stepper_trace_api(TRACE_STOP, 0, trace_t0_us + 5000000, 0, 0);
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_stop(NULL, &dropped));
+  TEST_ASSERT_GREATER_THAN_UINT32(0, dropped);
+
+  stepper_trace_reader_t reader;
+  stepper_trace_record_t record;
+  int stops = 0;
+  TEST_ASSERT_EQUAL(SUCCESS, stepper_trace_open(&reader, stream, stream_len));
+  while (stepper_trace_read(&reader, &record)) {
+    if (record.type == TRACE_RPM) TEST_ASSERT_EQUAL_INT64((int64_t) record.value * 1000000, record.time_ns);
+    if (record.type == TRACE_STOP) {
+      TEST_ASSERT_EQUAL_INT64(5000000000, record.time_ns);
+      stops++;
+    }
+  }
+  TEST_ASSERT_EQUAL(1, stops);
+}
+
+int main(int argc, char ** argv) {
+  UNITY_BEGIN();
+  RUN_TEST(test_edges_follow_rate_changes);
+  RUN_TEST(test_edges_across_stop_and_direction);
+  RUN_TEST(test_restart_starts_a_full_period);
+  RUN_TEST(test_sink_gets_halves);
+  RUN_TEST(test_drop_keeps_time_base);
+  RUN_TEST(test_shaped_replay_is_exact);
+  RUN_TEST(test_dual_edge_replay_is_exact);
+  return UNITY_END();
+}
@@ -0,0 +1,111 @@
+/**
+ * host-side benchmark of the fixed path (`stepper_fixed.h`) against the generic `stepper_update_rpm`,
+ * both driving the mocked step peripheral of the soft backend.
+ *
+ *   fixed_bench [iterations]
+ *       checks that both paths program the same registers, then reports the code size of each entry
+ *       point and the cost of one rpm update, in TSC cycles on x86 and in ns elsewhere.
+ *
+ * build (host, soft backend, without trace so the hooks cost nothing on either path):
+ *   cc -O2 -Ilib/stepper tools/fixed_bench.c lib/stepper/stepper_soft.c lib/stepper/stepper_feedback.c \
+ *      lib/stepper/stepper_shaper.c lib/stepper/stepper_idle.c lib/stepper/stepper_trace.c \
+ *      -rdynamic -ldl -lm -o fixed_bench
+*/
+
+#define _GNU_SOURCE
+
+#define STEPPER_FIXED_INSTANCES(X)  \
+  X(0, 1, 2, 3200, 3)               \
+  X(1, 4, 5, 3200, 3)
+
+#include "stepper_fixed.h"
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <link.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT  "cycles"
+static inline uint64_t bench_now(void) { return __rdtsc(); }
+#else
+#define BENCH_UNIT  "ns"
+static inline uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+// entry points, not inlined into the loops below, so both are called the same way.
+__attribute__((noinline)) stepper_err_t bench_fixed_rpm(float rpm) {
+  return stepper_fixed_0_update_rpm(rpm);
+}
+
+__attribute__((noinline)) stepper_err_t bench_generic_rpm(float rpm) {
+  return stepper_update_rpm(&stepper_fixed_1, rpm);
+}
+
+// size of the function at `address`, from the dynamic symbol table, 0 when not exported.
+static size_t symbol_size(void * address) {
+  Dl_info info;
+  const ElfW(Sym) * symbol = NULL;
+  if (!dladdr1(address, &info, (void **) &symbol, RTLD_DL_SYMENT) || symbol == NULL) return 0;
+  return symbol->st_size;
+}
+
+static int same_registers(void) {
+  stepper_soft_regs_t const * a = &stepper_soft_periphs[0].regs;
+  stepper_soft_regs_t const * b = &stepper_soft_periphs[1].regs;
+  return a->top == b->top && a->duty == b->duty && a->dir == b->dir;
+}
+
+static double cost_per_call(stepper_err_t (*update_rpm)(float), int iterations) {
+  uint64_t best = UINT64_MAX;
+  for (int round = 0; round < 5; round++) {
+    uint64_t begin = bench_now();
+    for (int i = 0; i < iterations; i++) {
+      update_rpm((float)(60 + (i & 63)));
+    }
+    uint64_t elapsed = bench_now() - begin;
+    if (elapsed < best) best = elapsed;
+  }
+  return (double) best / iterations;
+}
+
+int main(int argc, char ** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: fixed_bench [iterations]\n");
+    return 2;
+  }
+
+  if (stepper_fixed_0_init() != SUCCESS || stepper_fixed_1_init() != SUCCESS) {
+    fprintf(stderr, "init failed\n");
+    return 1;
+  }
+  stepper_start(&stepper_fixed_0);
+  stepper_start(&stepper_fixed_1);
+
+  for (int rpm = 1; rpm <= 600; rpm++) {
+    bench_fixed_rpm((float) rpm);
+    bench_generic_rpm((float) rpm);
+    if (!same_registers()) {
+      fprintf(stderr, "registers differ at %d rpm: top %u / %u, duty %u / %u\n", rpm,
+              stepper_soft_periphs[0].regs.top, stepper_soft_periphs[1].regs.top,
+              stepper_soft_periphs[0].regs.duty, stepper_soft_periphs[1].regs.duty);
+      return 1;
+    }
+  }
+
+  double fixed   = cost_per_call(bench_fixed_rpm, iterations);
+  double generic = cost_per_call(bench_generic_rpm, iterations);
+
+  // the generic entry point calls into static helpers of the backend, its size is a lower bound.
+  printf("%-10s %10s %14s\n", "path", "bytes", BENCH_UNIT "/call");
+  printf("%-10s %10zu %14.1f\n", "fixed", symbol_size((void *) bench_fixed_rpm), fixed);
+  printf("%-10s %10zu %14.1f\n", "generic", symbol_size((void *) stepper_update_rpm), generic);
+  return 0;
+}
@@ -0,0 +1,81 @@
+/**
+ * host-side benchmark of the input shaper (`lib/stepper/stepper_shaper.h`), the work the backends do
+ * on every rate update: one `stepper_shaper_input`, then `stepper_shaper_output` and `stepper_shaper_next`
+ * at each output change.
+ *
+ *   shaper_bench [iterations]
+ *       cost per call of each, unshaped and for every shaper type, with the history kept full so that
+ *       every input merges two changes (worst case). in TSC cycles on x86 and in ns elsewhere, the
+ *       unshaped row is mostly the cost of the measurement itself.
+ *
+ * build (host):
+ *   cc -O2 -Ilib/stepper tools/shaper_bench.c lib/stepper/stepper_shaper.c -lm -o shaper_bench
+*/
+
+#include "stepper_shaper.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_UNIT  "cycles"
+static inline uint64_t bench_now(void) { return __rdtsc(); }
+#else
+#define BENCH_UNIT  "ns"
+static inline uint64_t bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+static volatile int64_t sink;  // keeps the results alive.
+
+static void bench(char const * name, stepper_shaper_type_t type, float freq_hz, int iterations) {
+  stepper_shaper_t shaper;
+  if (stepper_shaper_init(&shaper, type, freq_hz, 0.05f) != SUCCESS) {
+    fprintf(stderr, "%s: invalid shaper\n", name);
+    exit(1);
+  }
+  // changes 100us apart stay in flight for the whole delay of the shaper, the history is full.
+  int64_t now_us  = 0;
+  int64_t next_us = 0;
+  for (int i = 0; i < 4 * STEPPER_SHAPER_HISTORY; i++) {
+    now_us += 100;
+    stepper_shaper_input(&shaper, now_us, 1000 + (i & 1) * 500);
+  }
+
+  uint64_t input = 0, output = 0, next = 0;
+  for (int i = 0; i < iterations; i++) {
+    now_us += 100;
+    uint64_t begin = bench_now();
+    stepper_shaper_input(&shaper, now_us, 1000 + (i & 1) * 500);
+    uint64_t middle = bench_now();
+    sink += stepper_shaper_output(&shaper, now_us);
+    uint64_t end = bench_now();
+    sink += stepper_shaper_next(&shaper, now_us, &next_us);
+    uint64_t last = bench_now();
+    input  += middle - begin;
+    output += end - middle;
+    next   += last - end;
+  }
+  printf("%-12s %10.1f %10.1f %10.1f %10u\n", name, (double) input / iterations, (double) output / iterations,
+         (double) next / iterations, shaper.length);
+}
+
+int main(int argc, char ** argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000000;
+  if (iterations <= 0) {
+    fprintf(stderr, "usage: shaper_bench [iterations]\n");
+    return 2;
+  }
+  printf("%s per call\n", BENCH_UNIT);
+  printf("%-12s %10s %10s %10s %10s\n", "shaper", "input", "output", "next", "history");
+  bench("none",       STEPPER_SHAPER_NONE, 0,  iterations);
+  bench("zv 30Hz",    STEPPER_SHAPER_ZV,   30, iterations);
+  bench("zvd 30Hz",   STEPPER_SHAPER_ZVD,  30, iterations);
+  bench("zvd 10Hz",   STEPPER_SHAPER_ZVD,  10, iterations);
+  bench("ei 10Hz",    STEPPER_SHAPER_EI,   10, iterations);
+  return 0;
+}
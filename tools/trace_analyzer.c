@@ -0,0 +1,330 @@
+/**
+ * host-side tool for the binary motion trace, see `lib/stepper/stepper_trace.h`.
+ *
+ *   trace_analyzer analyze <trace> [--window-ms N] [--bin-ns N] [--csv FILE]
+ *       one streaming pass over the memory-mapped trace: step interval jitter histogram, velocity /
+ *       acceleration curves (csv, one row per window and instance), and deviation of the emitted
+ *       position from the commanded profile.
+ *
+ *   trace_analyzer replay <trace>
+ *       feed the recorded API calls into the soft backend with their timestamps, record again, and
+ *       compare both edge sequences.
+ *
+ * build (host, soft backend):
+ *   cc -O2 -DSTEPPER_TRACE -Ilib/stepper tools/trace_analyzer.c lib/stepper/stepper_trace.c \
+ *      lib/stepper/stepper_soft.c lib/stepper/stepper_feedback.c lib/stepper/stepper_shaper.c \
+ *      lib/stepper/stepper_idle.c -lm -o trace_analyzer
+*/
+
+#include "stepper.h"
+#include "stepper_soft.h"
+#include "stepper_trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define HIST_BINS 64  // around the commanded interval, plus underflow and overflow.
+
+typedef struct {
+  bool      seen;
+  uint32_t  subdivision;
+  // commanded profile, from the API records.
+  int32_t   milli_rpm;
+  bool      cmd_direction;
+  bool      cmd_running;
+  double    cmd_position;
+  int64_t   cmd_stamp_ns;
+  // emitted steps, from the reconstructed edges.
+  int64_t   position;
+  int64_t   last_edge_ns;   // -1 after the output restarted.
+  uint64_t  edges;
+  uint64_t  intervals;
+  double    jitter_sum;
+  double    jitter_sq_sum;
+  int64_t   jitter_min;
+  int64_t   jitter_max;
+  uint64_t  hist[HIST_BINS + 2];
+  double    deviation_max;
+  double    deviation_sq_sum;
+  // velocity windows.
+  int64_t   window_start_ns;
+  int64_t   window_steps;
+  double    velocity;
+} axis_t;
+
+static axis_t   axes[STEPPER_TRACE_MAX_INSTANCE];
+static int64_t  window_ns = 10 * 1000000LL;
+static int64_t  bin_ns    = 100;
+static FILE *   csv       = NULL;
+
+static uint8_t const * map_file(char const * path, size_t * length) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) { perror(path); return NULL; }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size == 0) { fprintf(stderr, "%s: empty trace\n", path); close(fd); return NULL; }
+  void * data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) { perror("mmap"); return NULL; }
+  madvise(data, st.st_size, MADV_SEQUENTIAL);
+  *length = st.st_size;
+  return data;
+}
+
+/************************************** analyze *******************************************/
+
+// commanded velocity in steps/s, signed.
+static double cmd_velocity(axis_t const * axis) {
+  if (!axis->cmd_running) return 0;
+  double velocity = axis->milli_rpm / 1000.0 * axis->subdivision / 60;
+  return axis->cmd_direction ? velocity : -velocity;
+}
+
+static void advance(axis_t * axis, int id, int64_t time_ns) {
+  // close the windows passed.
+  while (time_ns >= axis->window_start_ns + window_ns) {
+    int64_t end_ns  = axis->window_start_ns + window_ns;
+    axis->cmd_position += cmd_velocity(axis) * (end_ns - axis->cmd_stamp_ns) / 1e9;
+    axis->cmd_stamp_ns  = end_ns;
+
+    double velocity     = axis->window_steps * 1e9 / window_ns;
+    double acceleration = (velocity - axis->velocity) * 1e9 / window_ns;
+    axis->velocity      = velocity;
+    if (csv) {
+      fprintf(csv, "%d,%.3f,%.3f,%.3f,%.3f,%.3f\n", id, end_ns / 1e6, velocity, acceleration,
+              cmd_velocity(axis), axis->position - axis->cmd_position);
+    }
+    axis->window_start_ns = end_ns;
+    axis->window_steps    = 0;
+  }
+  axis->cmd_position += cmd_velocity(axis) * (time_ns - axis->cmd_stamp_ns) / 1e9;
+  axis->cmd_stamp_ns  = time_ns;
+}
+
+static void on_edge(axis_t * axis, stepper_trace_record_t const * edge) {
+  int step = edge->value ? 1 : -1;
+  axis->position     += step;
+  axis->window_steps += step;
+  axis->edges++;
+
+  double deviation = fabs(axis->position - axis->cmd_position);
+  if (deviation > axis->deviation_max) axis->deviation_max = deviation;
+  axis->deviation_sq_sum += deviation * deviation;
+
+  double velocity = fabs(cmd_velocity(axis));
+  if (axis->last_edge_ns > -1 && velocity > 0) {
+    int64_t jitter = (edge->time_ns - axis->last_edge_ns) - (int64_t)(1e9 / velocity);
+    if (axis->intervals == 0 || jitter < axis->jitter_min) axis->jitter_min = jitter;
+    if (axis->intervals == 0 || jitter > axis->jitter_max) axis->jitter_max = jitter;
+    axis->jitter_sum    += jitter;
+    axis->jitter_sq_sum += (double) jitter * jitter;
+    axis->intervals++;
+
+    int64_t bin = jitter / bin_ns + HIST_BINS / 2;
+    if (jitter < 0 && jitter % bin_ns) bin--;  // floor.
+    if      (bin < 0)          axis->hist[0]++;
+    else if (bin >= HIST_BINS) axis->hist[HIST_BINS + 1]++;
+    else                       axis->hist[bin + 1]++;
+  }
+  axis->last_edge_ns = edge->time_ns;
+}
+
+static void on_record(axis_t * axis, stepper_trace_record_t const * record) {
+  switch (record->type) {
+    case TRACE_INIT:
+      axis->subdivision   = record->value;
+      axis->cmd_running   = false;
+      break;
+    case TRACE_RPM:
+      axis->milli_rpm     = record->value;
+      // same threshold as the backends, stopped below 10 Hz.
+      axis->cmd_running   = (int64_t) record->value * axis->subdivision / 60000 >= 10;
+      break;
+    case TRACE_DIRECTION:
+      axis->cmd_direction = record->value;
+      break;
+    case TRACE_START:
+      axis->cmd_running   = true;
+      break;
+    case TRACE_STOP:
+      axis->cmd_running   = false;
+      break;
+    default:
+      break;
+  }
+  if (record->type == TRACE_RATE || record->type == TRACE_START || record->type == TRACE_STOP) {
+    axis->last_edge_ns = -1;  // interval across a new period or a stop is not jitter.
+  }
+}
+
+static void print_summary(int id, axis_t const * axis) {
+  printf("instance %d: %llu steps, position %lld, commanded %.1f\n", id,
+         (unsigned long long) axis->edges, (long long) axis->position, axis->cmd_position);
+  printf("  deviation: max %.1f steps, rms %.2f steps\n", axis->deviation_max,
+         axis->edges ? sqrt(axis->deviation_sq_sum / axis->edges) : 0.0);
+  if (axis->intervals == 0) return;
+
+  double mean = axis->jitter_sum / axis->intervals;
+  printf("  interval jitter: mean %.1f ns, stddev %.1f ns, min %lld ns, max %lld ns\n", mean,
+         sqrt(fmax(axis->jitter_sq_sum / axis->intervals - mean * mean, 0)),
+         (long long) axis->jitter_min, (long long) axis->jitter_max);
+  if (axis->hist[0]) printf("    < %6lld ns: %llu\n", (long long)(-HIST_BINS / 2 * bin_ns), (unsigned long long) axis->hist[0]);
+  for (int i = 0; i < HIST_BINS; i++) {
+    if (axis->hist[i + 1] == 0) continue;
+    printf("    %6lld ns: %llu\n", (long long)((i - HIST_BINS / 2) * bin_ns), (unsigned long long) axis->hist[i + 1]);
+  }
+  if (axis->hist[HIST_BINS + 1]) printf("    >=%6lld ns: %llu\n", (long long)(HIST_BINS / 2 * bin_ns), (unsigned long long) axis->hist[HIST_BINS + 1]);
+}
+
+static int analyze(uint8_t const * data, size_t length) {
+  stepper_trace_reader_t reader;
+  if (stepper_trace_open(&reader, data, length) != SUCCESS) {
+    fprintf(stderr, "not a stepper trace\n");
+    return 1;
+  }
+  if (csv) fprintf(csv, "instance,time_ms,velocity,acceleration,commanded_velocity,deviation\n");
+
+  stepper_trace_record_t record;
+  while (stepper_trace_next(&reader, &record)) {
+    if (record.type == TRACE_END) break;
+    axis_t * axis = &axes[record.instance_id];
+    if (!axis->seen) {
+      axis->seen          = true;
+      axis->last_edge_ns  = -1;
+      axis->window_start_ns = record.time_ns;
+      axis->cmd_stamp_ns  = record.time_ns;
+    }
+    advance(axis, record.instance_id, record.time_ns);
+    if (record.type == TRACE_EDGE) {
+      on_edge(axis, &record);
+    } else {
+      on_record(axis, &record);
+    }
+  }
+  if (reader.offset < reader.length && record.type != TRACE_END) {
+    fprintf(stderr, "warning: trace is truncated at byte %zu\n", reader.offset);
+  }
+
+  for (int i = 0; i < STEPPER_TRACE_MAX_INSTANCE; i++) {
+    if (axes[i].seen) print_summary(i, &axes[i]);
+  }
+  return 0;
+}
+
+/*************************************** replay *******************************************/
+
+typedef struct {
+  uint8_t * data;
+  size_t    length;
+  size_t    capacity;
+} memory_sink_t;
+
+static void memory_sink(void * context, uint8_t const * data, uint32_t length) {
+  memory_sink_t * sink = context;
+  if (sink->length + length > sink->capacity) {
+    sink->capacity = (sink->length + length) * 2;
+    sink->data     = realloc(sink->data, sink->capacity);
+    if (sink->data == NULL) { perror("realloc"); exit(1); }
+  }
+  memcpy(&sink->data[sink->length], data, length);
+  sink->length += length;
+}
+
+static int replay(uint8_t const * data, size_t length) {
+  stepper_trace_reader_t reader;
+  if (stepper_trace_open(&reader, data, length) != SUCCESS) {
+    fprintf(stderr, "not a stepper trace\n");
+    return 1;
+  }
+
+  static uint8_t staging[64 * 1024];
+  memory_sink_t sink = { 0 };
+  if (stepper_trace_start(staging, sizeof(staging), memory_sink, &sink) != SUCCESS) {
+    fprintf(stderr, "recording is not available, build with -DSTEPPER_TRACE\n");
+    return 1;
+  }
+
+  stepper_t instances[STEPPER_TRACE_MAX_INSTANCE];
+  for (int i = 0; i < STEPPER_TRACE_MAX_INSTANCE; i++) instances[i].instance_id = i;
+
+  stepper_trace_record_t record;
+  uint64_t calls = 0;
+  while (stepper_trace_read(&reader, &record)) {
+    stepper_t const * stepper = &instances[record.instance_id];
+    stepper_soft_set_time(record.time_ns / 1000);
+    switch (record.type) {
+      case TRACE_INIT: {
+        stepper_config_t config;
+        stepper_trace_config(&record, &config);  // shaper included, it changes the edges.
+        stepper_init(stepper, &config);
+        break;
+      }
+      case TRACE_RPM:       stepper_update_rpm(stepper, record.value / 1000.0f);  break;
+      case TRACE_DIRECTION: stepper_update_direction(stepper, record.value);      break;
+      case TRACE_START:     stepper_start(stepper);                               break;
+      case TRACE_STOP:      stepper_stop(stepper);                                break;
+      default:              continue;  // emitted by the driver, not an API call.
+    }
+    calls++;
+  }
+  uint32_t dropped = 0;
+  stepper_trace_stop(NULL, &dropped);
+
+  // compare the edge sequences.
+  stepper_trace_reader_t original, replayed;
+  stepper_trace_open(&original, data, length);
+  stepper_trace_open(&replayed, sink.data, sink.length);
+  stepper_trace_record_t a, b;
+  uint64_t edges = 0;
+  for (;;) {
+    bool has_a, has_b;
+    while ((has_a = stepper_trace_next(&original, &a)) && a.type != TRACE_EDGE);
+    while ((has_b = stepper_trace_next(&replayed, &b)) && b.type != TRACE_EDGE);
+    if (!has_a && !has_b) break;
+    if (has_a != has_b || a.instance_id != b.instance_id || a.time_ns != b.time_ns || a.value != b.value) {
+      printf("edge %llu differs: recorded ", (unsigned long long) edges);
+      if (has_a) printf("#%d %lld ns %s", a.instance_id, (long long) a.time_ns, a.value ? "+" : "-"); else printf("none");
+      printf(", replayed ");
+      if (has_b) printf("#%d %lld ns %s", b.instance_id, (long long) b.time_ns, b.value ? "+" : "-"); else printf("none");
+      printf("\n");
+      free(sink.data);
+      return 1;
+    }
+    edges++;
+  }
+  printf("%llu calls replayed, %llu edges identical\n", (unsigned long long) calls, (unsigned long long) edges);
+  free(sink.data);
+  return dropped ? 1 : 0;
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 3 || (strcmp(argv[1], "analyze") && strcmp(argv[1], "replay"))) {
+    fprintf(stderr, "usage: %s analyze <trace> [--window-ms N] [--bin-ns N] [--csv FILE]\n"
+                    "       %s replay <trace>\n", argv[0], argv[0]);
+    return 2;
+  }
+  for (int i = 3; i + 1 < argc; i += 2) {
+    if      (!strcmp(argv[i], "--window-ms")) window_ns = atoll(argv[i + 1]) * 1000000LL;
+    else if (!strcmp(argv[i], "--bin-ns"))    bin_ns    = atoll(argv[i + 1]);
+    else if (!strcmp(argv[i], "--csv"))       csv       = fopen(argv[i + 1], "w");
+  }
+  if (window_ns <= 0 || bin_ns <= 0) {
+    fprintf(stderr, "invalid window or bin\n");
+    return 2;
+  }
+
+  size_t length = 0;
+  uint8_t const * data = map_file(argv[2], &length);
+  if (data == NULL) return 1;
+
+  int ret = strcmp(argv[1], "analyze") ? replay(data, length) : analyze(data, length);
+
+  if (csv) fclose(csv);
+  munmap((void *) data, length);
+  return ret;
+}